@@ -0,0 +1,242 @@
+#include "InotifyBatchIndex.h"
+
+extern "C" {
+	#include <string.h>
+	#include <stdint.h>
+}
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+#if defined(__AVX2__)
+#define INDEX_LANES		8
+#elif defined(__SSE2__)
+#define INDEX_LANES		4
+#else
+#define INDEX_LANES		1
+#endif
+
+/*
+ * 一组 INDEX_LANES 个事件的过滤结果，第 n 位为 1 表示第 n 个事件被选中
+ */
+static inline unsigned index_match(const uint32_t * masks,const int32_t * wds,uint32_t events,const int * want,size_t count)
+{
+#if defined(__AVX2__)
+	const __m256i zero = _mm256_setzero_si256();
+	unsigned bits = 0xFF;
+	if(events != 0) {
+		__m256i v	= _mm256_loadu_si256((const __m256i *)masks);
+		__m256i miss	= _mm256_cmpeq_epi32(_mm256_and_si256(v,_mm256_set1_epi32((int)events)),zero);
+		bits = ~(unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(miss)) & 0xFF;
+	}
+
+	if(bits != 0 && count != 0) {
+		__m256i v	= _mm256_loadu_si256((const __m256i *)wds);
+		__m256i hit	= zero;
+		for(size_t k = 0; k < count; k++)
+		{
+			hit = _mm256_or_si256(hit,_mm256_cmpeq_epi32(v,_mm256_set1_epi32(want[k])));
+		}
+		bits &= (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(hit));
+	}
+	return bits;
+#elif defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	unsigned bits = 0xF;
+	if(events != 0) {
+		__m128i v	= _mm_loadu_si128((const __m128i *)masks);
+		__m128i miss	= _mm_cmpeq_epi32(_mm_and_si128(v,_mm_set1_epi32((int)events)),zero);
+		bits = ~(unsigned)_mm_movemask_ps(_mm_castsi128_ps(miss)) & 0xF;
+	}
+
+	if(bits != 0 && count != 0) {
+		__m128i v	= _mm_loadu_si128((const __m128i *)wds);
+		__m128i hit	= zero;
+		for(size_t k = 0; k < count; k++)
+		{
+			hit = _mm_or_si128(hit,_mm_cmpeq_epi32(v,_mm_set1_epi32(want[k])));
+		}
+		bits &= (unsigned)_mm_movemask_ps(_mm_castsi128_ps(hit));
+	}
+	return bits;
+#else
+	if(events != 0 && (masks[0] & events) == 0) {
+		return 0;
+	}
+
+	if(count == 0) {
+		return 1;
+	}
+
+	for(size_t k = 0; k < count; k++)
+	{
+		if(wds[0] == want[k]) {
+			return 1;
+		}
+	}
+	return 0;
+#endif
+}
+
+
+namespace inotify {
+
+InotifyBatchIndex::InotifyBatchIndex()
+{
+	this->m_buffer = NULL;
+}
+
+
+InotifyBatchIndex::~InotifyBatchIndex()
+{
+}
+
+
+size_t InotifyBatchIndex::build(const char * buffer,size_t len)
+{
+	this->clear();
+	if(buffer == NULL) {
+		return 0;
+	}
+
+	this->m_buffer = buffer;
+
+	/* 最短的事件是没有 name 的记录头 */
+	size_t reserve = len / sizeof(struct InotifyEvent);
+	this->m_wds.reserve(reserve);
+	this->m_masks.reserve(reserve);
+	this->m_offsets.reserve(reserve);
+
+	size_t offset = 0;
+	while(offset + sizeof(struct InotifyEvent) <= len)
+	{
+		const InotifyEvent * event = (const InotifyEvent *)(buffer + offset);
+		size_t next = offset + sizeof(struct InotifyEvent) + event->len;
+		if(next > len) {
+			break;
+		}
+
+		this->m_wds.push_back(event->wd);
+		this->m_masks.push_back(event->mask);
+		this->m_offsets.push_back((uint32_t)offset);
+		offset = next;
+	}
+
+	return this->m_wds.size();
+}
+
+
+size_t InotifyBatchIndex::build(const char * buffer,InotifyEvent * const events[],size_t count)
+{
+	this->clear();
+	if(buffer == NULL || events == NULL) {
+		return 0;
+	}
+
+	this->m_buffer = buffer;
+	this->m_wds.reserve(count);
+	this->m_masks.reserve(count);
+	this->m_offsets.reserve(count);
+
+	for(size_t i = 0; i < count; i++)
+	{
+		this->m_wds.push_back(events[i]->wd);
+		this->m_masks.push_back(events[i]->mask);
+		this->m_offsets.push_back((uint32_t)((const char *)events[i] - buffer));
+	}
+
+	return this->m_wds.size();
+}
+
+
+void InotifyBatchIndex::clear()
+{
+	this->m_buffer = NULL;
+	this->m_wds.clear();
+	this->m_masks.clear();
+	this->m_offsets.clear();
+}
+
+
+size_t InotifyBatchIndex::size() const
+{
+	return this->m_wds.size();
+}
+
+
+int InotifyBatchIndex::wd(size_t i) const
+{
+	return this->m_wds[i];
+}
+
+
+uint32_t InotifyBatchIndex::mask(size_t i) const
+{
+	return this->m_masks[i];
+}
+
+
+const InotifyEvent * InotifyBatchIndex::event(size_t i) const
+{
+	return (const InotifyEvent *)(this->m_buffer + this->m_offsets[i]);
+}
+
+
+size_t InotifyBatchIndex::filter(uint32_t events,const int * wds,size_t count,std::vector<uint32_t> & selected) const
+{
+	selected.clear();
+	if(wds == NULL) {
+		count = 0;
+	}
+
+	size_t size = this->m_wds.size();
+	if(size == 0) {
+		return 0;
+	}
+
+	const uint32_t * masks	= &this->m_masks[0];
+	const int32_t * ids		= &this->m_wds[0];
+
+	size_t i = 0;
+	for(; i + INDEX_LANES <= size; i += INDEX_LANES)
+	{
+		unsigned bits = index_match(masks + i,ids + i,events,wds,count);
+		while(bits != 0)
+		{
+			selected.push_back((uint32_t)(i + __builtin_ctz(bits)));
+			bits &= bits - 1;
+		}
+	}
+
+	/* 不足一组的尾部补齐后再比较一次，补齐的部分不会被选中 */
+	if(i < size) {
+		uint32_t tail_masks[8];
+		int32_t tail_wds[8];
+		memset(tail_masks,0,sizeof(tail_masks));
+		memset(tail_wds,0,sizeof(tail_wds));
+		memcpy(tail_masks,masks + i,(size - i) * sizeof(uint32_t));
+		memcpy(tail_wds,ids + i,(size - i) * sizeof(int32_t));
+
+		unsigned bits = index_match(tail_masks,tail_wds,events,wds,count) & ((1U << (size - i)) - 1);
+		while(bits != 0)
+		{
+			selected.push_back((uint32_t)(i + __builtin_ctz(bits)));
+			bits &= bits - 1;
+		}
+	}
+
+	return selected.size();
+}
+
+
+size_t InotifyBatchIndex::filter(uint32_t events,std::vector<uint32_t> & selected) const
+{
+	return this->filter(events,NULL,0,selected);
+}
+
+
+}//namespace inotify
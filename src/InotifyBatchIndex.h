@@ -0,0 +1,74 @@
+#ifndef __INOTIFY_BATCH_INDEX_H__
+#define __INOTIFY_BATCH_INDEX_H__
+
+
+/*
+    batch index
+    一次读到的事件是变长记录，逐个处理需要沿 event->len 跳转，并且会读到每个事件的 name
+    InotifyBatchIndex 先扫描一遍记录头，把 wd、mask、偏移分别放进三个数组（structure of arrays），
+    之后按 mask 和 wd 过滤时只读这两个连续的数组，用 SIMD 一次比较 8 个（AVX2）或 4 个（SSE2）事件，
+    只有被选中的事件才会访问原始缓冲区
+
+    SIMD 的版本在编译期选择（-mavx2 / 默认的 SSE2），其他平台使用标量实现，结果相同
+    索引引用原始缓冲区，不复制事件：缓冲区失效（例如下一次 read_event）后索引也失效
+*/
+
+#include <vector>
+#include "InotifyEventLoop.h"
+
+
+namespace inotify {
+
+class InotifyBatchIndex
+{
+public:
+    InotifyBatchIndex();
+    ~InotifyBatchIndex();
+
+public:
+    /*
+    *   扫描原始事件，建立索引，原有的索引被清空
+    *     buffer:  inotify 原始事件（read 读到的字节），可以是多次读取拼接的缓冲区     input
+    *        len:  字节数       input
+    *     return:  事件数量，末尾不完整的记录会被忽略
+    */
+    size_t  build(const char * buffer,size_t len);
+
+    /*
+    *   只为 events 中的事件建立索引（例如 process_events 放行的事件），原有的索引被清空
+    *     buffer:  事件所在的缓冲区     input
+    *     events:  指向 buffer 中的事件，按原来的顺序     input
+    *      count:  事件数量     input
+    *     return:  事件数量
+    */
+    size_t  build(const char * buffer,InotifyEvent * const events[],size_t count);
+
+    void    clear();
+    size_t  size() const;
+
+    int                     wd(size_t i) const;
+    uint32_t                mask(size_t i) const;
+    const InotifyEvent *    event(size_t i) const;
+
+    /*
+    *   选出 (mask & events) != 0 并且 wd 在 wds 中的事件
+    *     events:  关心的事件，0 表示不按事件过滤        input
+    *        wds:  关心的wd，NULL 或 count 为 0 表示不按wd过滤     input
+    *   selected:  选中的事件在索引中的下标，按原来的顺序   output
+    *     return:  选中的数量
+    */
+    size_t  filter(uint32_t events,const int * wds,size_t count,std::vector<uint32_t> & selected) const;
+
+    size_t  filter(uint32_t events,std::vector<uint32_t> & selected) const;
+
+private:
+    const char *                    m_buffer;
+    std::vector<int32_t>            m_wds;
+    std::vector<uint32_t>           m_masks;
+    std::vector<uint32_t>           m_offsets;      /* 事件在 m_buffer 中的偏移 */
+};
+
+
+}//namespace inotify
+
+#endif
@@ -1,4 +1,7 @@
 #include "InotifyEventLoop.h"
+#include "InotifyPoller.h"
+#include "InotifyRecord.h"
+#include "InotifyBatchIndex.h"
 
 extern "C" {
 	#include <sys/syscall.h>
@@ -17,9 +20,12 @@ extern "C" {
 	#include <time.h>
 	#include <regex.h>
 	#include <setjmp.h>
+	#include <math.h>
 }
 
 #include <stack>
+#include <set>
+#include <algorithm>
 #include <iostream>
 
 
@@ -132,9 +138,124 @@ static inline int inotify_rm_watch (int fd, uint32_t wd)
 	return syscall (__NR_inotify_rm_watch, fd, wd);
 }
 
+static inline uint64_t monotonic_ms (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline void tree_put32(std::string & out,uint32_t v)
+{
+	out.append((const char *)&v,sizeof(v));
+}
+
+static inline void tree_put_str(std::string & out,const std::string & v)
+{
+	tree_put32(out,(uint32_t)v.length());
+	out.append(v);
+}
+
+static inline bool tree_get32(const char * & p,const char * end,uint32_t & v)
+{
+	if((size_t)(end - p) < sizeof(v)) {
+		return false;
+	}
+	memcpy(&v,p,sizeof(v));
+	p += sizeof(v);
+	return true;
+}
+
+static inline bool tree_get_str(const char * & p,const char * end,std::string & v)
+{
+	uint32_t len;
+	if(!tree_get32(p,end,len) || (size_t)(end - p) < len) {
+		return false;
+	}
+	v.assign(p,len);
+	p += len;
+	return true;
+}
+
 
 namespace inotify {
 
+class NativeOps : public InotifyOps
+{
+public:
+	int init()
+	{
+		return inotify_init();
+	}
+
+	int read(int fd,char * buffer,size_t size)
+	{
+		unsigned int bytes_to_read;
+		int rc = -1;
+		do {
+			rc = ioctl( fd, FIONREAD, &bytes_to_read );
+		} while ( !rc &&
+		          bytes_to_read < sizeof(struct InotifyEvent) );
+
+		if ( rc == -1 ) {
+			return -1;
+		}
+
+		return ::read(fd,buffer,size);
+	}
+
+	int add_watch(int fd,const char * path,uint32_t mask)
+	{
+		return inotify_add_watch(fd,path,mask);
+	}
+
+	int rm_watch(int fd,int wd)
+	{
+		return inotify_rm_watch(fd,wd);
+	}
+
+	int is_dir(const char * path)
+	{
+		struct stat64 my_stat;
+		if ( -1 == lstat64( path, &my_stat ) ) {
+			return errno == ENOENT ? -1 : -2;
+		}
+
+		return S_ISDIR( my_stat.st_mode ) && !S_ISLNK( my_stat.st_mode ) ? 1 : 0;
+	}
+
+	int list_dir(const char * path,std::vector<DirEntry> & entries)
+	{
+		DIR * dir = opendir(path);
+		if(dir == NULL) {
+			return -1;
+		}
+
+		struct dirent * ent = NULL;
+		while((ent = readdir(dir)) != NULL)
+		{
+			if(0 == strcmp(ent->d_name,".") || 0 == strcmp(ent->d_name,"..")) {
+				continue;
+			}
+
+			DirEntry entry;
+			entry.name	= ent->d_name;
+			entry.type	= ent->d_type;
+			entries.push_back(entry);
+		}
+
+		closedir(dir);
+		return 0;
+	}
+};
+
+InotifyOps * InotifyOps::native()
+{
+	static NativeOps s_native;
+	return &s_native;
+}
+
+
 InotifyEventLoop::InotifyEventLoop()
 {
 	this->m_init			= false;
@@ -143,7 +264,22 @@ InotifyEventLoop::InotifyEventLoop()
 
 	this->m_event_buffer_size 	= 8192;
 	this->m_event_buffer		= (char *)calloc(8192,sizeof(char));
-	this->m_is_recursively		= false;
+	this->m_epoll_event			= NULL;
+	this->m_next_root			= 0;
+	this->m_watch_budget		= 0;
+	this->m_cold_ms				= 60000;
+	this->m_evict_failed_at		= 0;
+	this->m_pending				= NULL;
+	this->m_pending_end			= NULL;
+	this->m_unread				= NULL;
+	this->m_unread_len			= 0;
+	this->m_read_seq			= 0;
+	this->m_rate_prune_at		= 1024;
+	this->m_record_batch		= NULL;
+	this->m_record_realtime		= 0;
+	this->m_record_monotonic	= 0;
+	this->m_poller				= NULL;
+	this->m_ops					= InotifyOps::native();
 	
 	this->m_moved_from 		= false;
     this->m_moved_from_node = NULL;
@@ -163,7 +299,12 @@ InotifyEventLoop::~InotifyEventLoop()
 		this->m_epoll_event = NULL;
 	}
 
-	if(this->m_event_buffer == NULL) {
+	if(this->m_poller != NULL) {
+		delete this->m_poller;
+		this->m_poller = NULL;
+	}
+
+	if(this->m_event_buffer != NULL) {
 		free(this->m_event_buffer);
 	}
 }
@@ -181,7 +322,7 @@ bool InotifyEventLoop::init()
 	
 	this->m_error = 0;
 
-	this->m_inotify_fd = inotify_init();
+	this->m_inotify_fd = this->m_ops->init();
 	if (this->m_inotify_fd < 0)	{
 		this->m_error = errno;
 		goto __ERROR;
@@ -201,6 +342,24 @@ __ERROR:
 
 
 int  InotifyEventLoop::read_event(InotifyEvent * array[], uint16_t size,int * exception)
+{
+	/* 上一次没有处理完的事件还在缓冲区中，先返回它们 */
+	if(this->m_unread_len > 0) {
+		return this->process_events(this->m_unread,this->m_unread_len,array,size);
+	}
+
+	memset(this->m_event_buffer,0,this->m_event_buffer_size);
+	int  count = this->m_ops->read(this->m_inotify_fd,this->m_event_buffer,this->m_event_buffer_size);
+	if ( count <= 0 ) {
+		this->m_error = errno;
+		return count;
+	}
+
+	return this->process_events(this->m_event_buffer,count,array,size);
+}
+
+
+int  InotifyEventLoop::process_events(char * buffer,int count,InotifyEvent * array[], uint16_t size)
 {
 	unsigned int events = -1;
 
@@ -208,257 +367,1114 @@ int  InotifyEventLoop::read_event(InotifyEvent * array[], uint16_t size,int * ex
 	char * 	pbuf = NULL;
 	struct InotifyEvent * event = NULL;
 	std::string path;
+	std::list<int> roots;
+	BlockNode * node = NULL;
+	uint64_t now = monotonic_ms();
 
-	
-	unsigned int bytes_to_read;
-	int rc = -1;
-	do {
-		rc = ioctl( this->m_inotify_fd, FIONREAD, &bytes_to_read );
-	} while ( !rc &&
-	          bytes_to_read < sizeof(struct InotifyEvent) );
-
-	if ( rc == -1 ) {
-		this->m_error = errno;
-		return false;
+	if(buffer != this->m_unread) {
+		this->m_read_seq++;
 	}
 
-	memset(this->m_event_buffer,0,this->m_event_buffer_size);
-	int  count = read(this->m_inotify_fd,this->m_event_buffer,this->m_event_buffer_size);
-	if ( size <= 0 ) {
-		this->m_error = errno;
-		return count;
+	if(!this->m_downgraded.empty()) {
+		this->rate_restore(now,false);
 	}
-	
-	for(pbuf = this->m_event_buffer; pbuf < this->m_event_buffer + count;)
+
+	for(pbuf = buffer; pbuf < buffer + count && number < size;)
 	{
 		event = (struct InotifyEvent *)pbuf;
 		if(this->m_moved_from && !(event->mask & IN_MOVED_TO))
 		{
-			if(this->m_moved_from_node != NULL) {
-				this->remove_watch_wd(this->m_moved_from_node->wd);
-			}
-			
-			this->m_moved_from_node = NULL;
-			this->m_moved_from		= false;
+			this->flush_moved_from();
+		}
+
+		/* 路径在目录树维护之前解析 */
+		size_t recorded = 0;
+		if(this->m_record_batch != NULL) {
+			recorded = this->m_record_batch->size();
+			this->m_record_batch->append(this,event,this->m_record_realtime,this->m_record_monotonic);
 		}
 
 		if(event->mask & IN_DELETE_SELF) {
 			this->remove_watch_wd(event->wd);
 		}
 
-		if(this->m_is_recursively)  
+		roots.clear();
+		node = this->watch_block_search(event->wd);
+		if(node != NULL) {
+			node->last_active = now;
+		}
+		events = this->inherit_roots(node,roots);
+
+		if(!roots.empty())  
 		{
-			if ( (event->mask & IN_CREATE) ||
+			this->m_pending		= pbuf;
+			this->m_pending_end	= buffer + count;
+			this->update_block(event,events,roots,path);
+			this->m_pending		= NULL;
+		}
+
+		/* 目录树维护不受限制，只是不返回给调用者 */
+		if(this->m_rate.window_ms != 0 && this->rate_admit(event,now) == false) {
+			if(this->m_record_batch != NULL) {
+				this->m_record_batch->truncate(recorded);
+			}
+			pbuf += sizeof(struct InotifyEvent) + event->len;
+			continue;
+		}
+	
+		array[number] = event;
+		number++;
+
+		pbuf += sizeof(struct InotifyEvent) + event->len;
+	}
+
+	this->m_unread		= pbuf < buffer + count ? pbuf : NULL;
+	this->m_unread_len	= (int)(buffer + count - pbuf);
+	return number;
+}
+
+
+void InotifyEventLoop::flush_moved_from()
+{
+	/* IN_MOVED_FROM 之后没有配对的 IN_MOVED_TO：移出了监控范围 */
+	if(this->m_moved_from_node != NULL) {
+		this->remove_watch_wd(this->m_moved_from_node->wd);
+	}
+	
+	this->m_moved_from_node = NULL;
+	this->m_moved_from		= false;
+}
+
+
+void InotifyEventLoop::update_block(InotifyEvent * event,unsigned events,const std::list<int> & roots,std::string & path)
+{
+	path.clear();
+
+	if ( (event->mask & IN_CREATE) ||
                 ( !(this->m_moved_from) && (event->mask & IN_MOVED_TO)) ) 
+	{
+		bool is_ok = this->get_path(event->wd,path);
+		if(is_ok == true) {
+			path.append(event->name);
+			int ret = this->is_dir(path.c_str());
+			switch (ret)
 			{
-				bool is_ok = this->get_path(event->wd,path);
-				if(is_ok == true) {
-					BlockNode * node = this->watch_block_search(event->wd);
-					if(node != NULL) {
-						events = node->events;
-					} else {
-						events = IN_ALL_EVENTS;
-					}
-					
-					path.append(event->name);
-					int ret = this->is_dir(path.c_str());
-					switch (ret)
-					{
-						case 0: this->add_watch_block_file(event->wd,path.c_str(),event->name,events,false); break;
-						case 1: this->add_watch_recursively(path.c_str(),events); break;
-						default:break;
+				case 0: 
+					if(this->add_watch_block_file(event->wd,path.c_str(),event->name,events,false,roots,NULL) == -1) {
+						this->add_crawl_failure(&this->m_crawl_report,event->wd,-1,event->name,false);
 					}
-				} else {
-				
-					
-				}
+					break;
+				case 1: this->add_watch_block_file_recursively(event->wd,path.c_str(),event->name,events,roots,NULL,&this->m_crawl_report); break;
+				default:break;
 			}
-			else if(event->mask & IN_MOVED_FROM ) 
-			{
-				BlockNode * node =  this->watch_block_search(event->wd);
-				if(node != NULL) 
-				{
-					int wd = this->get_child_wd(node,event->name);
-					if(wd != -1) {
-						BlockNode * node1 = this->watch_block_search(wd);
-						if(node1 != NULL) {
-							this->m_moved_from_node = node1;
-							this->m_moved_from 		= true;
-						}
-						else 
-						{
-							//std::cout<< "<==---IN_MOVED_FROM: watch_block_search child wd for node == NULL wd = "<< wd  <<std::endl;
-						}
-					} 
-					else 
-					{
-						//std::cout<< "<==---IN_MOVED_FROM: get_child_wd failed name = " << event->name <<std::endl;
-					}
+		} else {
+		
+			
+		}
+	}
+	else if(event->mask & IN_MOVED_FROM ) 
+	{
+		BlockNode * node =  this->watch_block_search(event->wd);
+		if(node != NULL) 
+		{
+			int wd = this->get_child_wd(node,event->name);
+			if(wd != -1) {
+				BlockNode * node1 = this->watch_block_search(wd);
+				if(node1 != NULL) {
+					this->m_moved_from_node = node1;
+					this->m_moved_from 		= true;
 				}
 				else 
 				{
-					//std::cout<<"<==---IN_MOVED_FROM: get moved_from node failed wd = " << event->wd << std::endl;
+					//std::cout<< "<==---IN_MOVED_FROM: watch_block_search child wd for node == NULL wd = "<< wd  <<std::endl;
 				}
+			} 
+			else 
+			{
+				//std::cout<< "<==---IN_MOVED_FROM: get_child_wd failed name = " << event->name <<std::endl;
 			}
+		}
+		else 
+		{
+			//std::cout<<"<==---IN_MOVED_FROM: get moved_from node failed wd = " << event->wd << std::endl;
+		}
+	}
 
-			else if (event->mask & IN_MOVED_TO)
-			{	
-				if(this->m_moved_from && this->m_moved_from_node != NULL) {
-					m_moved_from_node->parent_wd 	= event->wd;
-					m_moved_from_node->name 		= event->name;
-				}
+	else if (event->mask & IN_MOVED_TO)
+	{	
+		if(this->m_moved_from && this->m_moved_from_node != NULL) {
+			BlockNode * old_parent = this->watch_block_search(m_moved_from_node->parent_wd);
+			if(old_parent != NULL) {
+				old_parent->child.remove(m_moved_from_node->wd);
+			}
 
-				this->m_moved_from			= false;
-				this->m_moved_from_node 	= NULL;
+			BlockNode * new_parent = this->watch_block_search(event->wd);
+			if(new_parent != NULL) {
+				new_parent->add_child(m_moved_from_node->wd);
 			}
 
+			m_moved_from_node->parent_wd 	= event->wd;
+			m_moved_from_node->name 		= event->name;
+
+			/* 可能移动到了另一个根下面 */
+			this->watch_block_retag(m_moved_from_node);
 		}
-	
-		array[number] = event;
-		number++;
-		path.clear();
 
-		pbuf += sizeof(struct InotifyEvent) + event->len;
+		this->m_moved_from			= false;
+		this->m_moved_from_node 	= NULL;
 	}
+}
 
-	return number;
+
+uint64_t InotifyEventLoop::clock_ms()
+{
+	return monotonic_ms();
 }
 
 
-void  InotifyEventLoop::clear()
+bool InotifyEventLoop::rate_admit(InotifyEvent * event,uint64_t now)
 {
-	BlockNode * node = NULL;
-	std::map<int,BlockNode*>::iterator iter;
-	for(iter = this->m_block_map.begin(); iter != this->m_block_map.end(); )
-	{
-		inotify_rm_watch(this->m_inotify_fd,iter->first);
-		node = (BlockNode *)iter->second;
-		delete node;
-		this->m_block_map.erase(iter++);
+	BlockNode * node = this->watch_block_search(event->wd);
+	if(node == NULL) {
+		return true;
 	}
 
-	this->m_is_recursively = false;
-}
+	/* 带 name 的事件不查找子节点，按 (wd, name) 单独计数；目录只计自身的事件，也不会被降级 */
+	RateState * state = &node->rate_state;
+	bool can_downgrade = !node->is_dir;
+	if(event->len != 0) {
+		state = this->rate_child(event->wd,event->name,now);
+		can_downgrade = false;
+	}
 
-int InotifyEventLoop::error() {
-	return this->m_error;
-}
+	/* 衰减平均：r = r * exp(-dt / window) + 1 / window */
+	double window = this->m_rate.window_ms / 1000.0;
+	double dt = state->rate_at != 0 ? (now - state->rate_at) / 1000.0 : 0;
+	state->rate = state->rate * exp(-dt / window) + 1.0 / window;
 
-bool InotifyEventLoop::add_watch_file(const char * file,unsigned int events)
-{
-	if(file == NULL || this->m_init == false) {
-		return false;
+	if(state->rate_at == 0) {
+		state->tokens = this->m_rate.burst;
+	} else {
+		state->tokens += dt * this->m_rate.rate;
+		if(state->tokens > this->m_rate.burst) {
+			state->tokens = this->m_rate.burst;
+		}
 	}
+	state->rate_at = now;
 
-	int wd = inotify_add_watch( this->m_inotify_fd, file, events );
-	if(wd < 0) {
-		this->m_error = errno;
+	if(this->m_rate.policy == INOTIFY_RATE_NONE || !(event->mask & INOTIFY_RATE_EVENTS)) {
+		return true;
+	}
+
+	/* 降级期间仍然可能收到内核队列中已有的事件 */
+	if(state->downgrade_until != 0 && (event->mask & this->m_rate.downgrade_mask)) {
+		state->dropped++;
 		return false;
 	}
 
-	int ret =  this->is_dir(file);
-	BlockNode * node = NULL;
-	switch (ret)
+	if(state->tokens >= 1) {
+		state->tokens -= 1;
+		state->sampled = 0;
+		return true;
+	}
+
+	switch(this->m_rate.policy)
 	{
-	case 0: node = BlockNode::create(wd,INOTIFY_ROOT,events,file,false);
-			return watch_block_insert(node);
-	case 1: node = BlockNode::create(wd,INOTIFY_ROOT,events,file,true);
-			return watch_block_insert(node);
-	default:
-		return false;
-	}	
+		case INOTIFY_RATE_SAMPLE:
+			if(this->m_rate.sample <= 1 || state->sampled++ % this->m_rate.sample == 0) {
+				return true;
+			}
+			break;
+
+		case INOTIFY_RATE_DOWNGRADE:
+			if(can_downgrade == false) {
+				break;
+			}
+
+			if(state->downgrade_until == 0) {
+				std::string path;
+				if(this->get_path(node->wd,path) &&
+					this->m_ops->add_watch(this->m_inotify_fd,path.c_str(),node->events & ~this->m_rate.downgrade_mask) != -1) {
+					state->downgrade_until = now + this->m_rate.cooldown_ms;
+					if(state->downgrade_until == 0) {
+						state->downgrade_until = 1;
+					}
+					this->m_downgraded.push_back(node->wd);
+				}
+			}
+
+			if(!(event->mask & this->m_rate.downgrade_mask)) {
+				return true;
+			}
+			break;
 
+		default: break;
+	}
+
+	state->dropped++;
 	return false;
 }
 
-bool InotifyEventLoop::add_watch_files(const char * files[],unsigned int size,unsigned int events)
+
+RateState * InotifyEventLoop::rate_child(int wd,const char * name,uint64_t now)
 {
-	if(this->m_init != true) {
-		return false;
+	std::pair<int,std::string> key(wd,name);
+	std::map< std::pair<int,std::string>,RateState >::iterator iter = this->m_rate_children.find(key);
+	if(iter != this->m_rate_children.end()) {
+		return &iter->second;
 	}
 
-	for(unsigned int i = 0; i < size && files[i] ; ++ i )
-	{
-		bool is_ok =  add_watch_file(files[i],events);
-		if(is_ok == false ) {
-			return false;
+	/* 空闲到与新建的项没有区别（速率衰减完、令牌补满）的项可以去掉，目录已经不在监控中的项也去掉 */
+	if(this->m_rate_children.size() >= this->m_rate_prune_at) {
+		uint64_t idle = (uint64_t)this->m_rate.window_ms * 4;
+		if(this->m_rate.rate > 0 && this->m_rate.burst / this->m_rate.rate * 1000 > idle) {
+			idle = (uint64_t)(this->m_rate.burst / this->m_rate.rate * 1000);
+		}
+
+		for(iter = this->m_rate_children.begin(); iter != this->m_rate_children.end(); )
+		{
+			if(iter->second.rate_at + idle < now || this->watch_block_search(iter->first.first) == NULL) {
+				this->m_rate_children.erase(iter++);
+			} else {
+				iter++;
+			}
+		}
+
+		this->m_rate_prune_at = this->m_rate_children.size() * 2;
+		if(this->m_rate_prune_at < 1024) {
+			this->m_rate_prune_at = 1024;
 		}
 	}
-	
-	return true;
+
+	return &this->m_rate_children[key];
 }
 
-bool InotifyEventLoop::add_watch_recursively( const  char * path,unsigned int events )
+
+int InotifyEventLoop::rate_restore(uint64_t now,bool all)
 {
-	if(path == NULL || this->m_init != true || this->is_dir(path) != 1) {
-		return false;
+	int number = 0;
+	std::list<int>::iterator iter;
+	for(iter = this->m_downgraded.begin(); iter != this->m_downgraded.end(); )
+	{
+		BlockNode * node = this->watch_block_search(*iter);
+		if(node == NULL) {
+			this->m_downgraded.erase(iter++);
+			continue;
+		}
+
+		if(!all && now < node->rate_state.downgrade_until) {
+			iter++;
+			continue;
+		}
+
+		/* 不带 IN_MASK_ADD，恢复为完整的掩码 */
+		std::string path;
+		if(this->get_path(node->wd,path)) {
+			this->m_ops->add_watch(this->m_inotify_fd,path.c_str(),node->events);
+		}
+		node->rate_state.downgrade_until	= 0;
+		node->rate_state.tokens				= this->m_rate.burst;
+		this->m_downgraded.erase(iter++);
+		number++;
 	}
 
-	return add_watch_block_file_recursively(INOTIFY_ROOT,path,events) ;
+	return number;
 }
 
-int InotifyEventLoop::is_dir( char const * path ) 
+
+void InotifyEventLoop::set_rate_limit(const RateLimit & limit)
 {
-	static struct stat64 my_stat;
-	if ( -1 == lstat64( path, &my_stat ) ) {
-		if (errno == ENOENT) {
-			this->m_error = ENOENT;
-			return -1;
-		} else {
-			this->m_error = errno;
-			return -2;
-		}	
+	this->m_rate = limit;
+	if(limit.window_ms == 0 || limit.policy != INOTIFY_RATE_DOWNGRADE) {
+		this->rate_restore(monotonic_ms(),true);
 	}
 
-	if( S_ISDIR( my_stat.st_mode ) && !S_ISLNK( my_stat.st_mode ) )
-	{
-		return 1;
-	} else {
-		return 0;
+	if(limit.window_ms == 0) {
+		this->m_rate_children.clear();
 	}
 }
 
-void  InotifyEventLoop::remove_watch_wd(int wd)
-{
-	BlockNode * node = watch_block_search(wd);
-	if(node != NULL) {
 
-		if(node->parent_wd != INOTIFY_ROOT) 
-		{
-			BlockNode * parent_node = watch_block_search(node->parent_wd);
-			if(parent_node != NULL) {
-				std::list<int>::iterator iter;
-				for(iter = parent_node->child.begin();iter != parent_node->child.end(); iter++)
-				{
-					if( (*iter) == wd ) {
-						parent_node->child.erase(iter);
-						break;
-					}
-				}
-			}
-		}
-	
-		delete node;
-		inotify_rm_watch(this->m_inotify_fd,wd);
-	}
+int InotifyEventLoop::restore_downgraded()
+{
+	return this->rate_restore(monotonic_ms(),false);
 }
 
-int InotifyEventLoop::get_child_wd(BlockNode*node,std::string name)
+
+int InotifyEventLoop::next_rate_timeout()
 {
-	if(node == NULL) {
+	if(this->m_downgraded.empty()) {
 		return -1;
 	}
 
+	uint64_t now = monotonic_ms();
+	uint64_t next = 0;
 	std::list<int>::iterator iter;
-	for(iter = node->child.begin();iter != node->child.end(); iter++)
+	for(iter = this->m_downgraded.begin(); iter != this->m_downgraded.end(); iter++)
 	{
-		BlockNode*node = watch_block_search(*iter);
+		BlockNode * node = this->watch_block_search(*iter);
 		if(node == NULL) {
-			continue;
+			return 0;
 		}
 
-		if( node->name.find(name) !=  std::string::npos)
-		{
+		if(next == 0 || node->rate_state.downgrade_until < next) {
+			next = node->rate_state.downgrade_until;
+		}
+	}
+
+	return next > now ? (int)(next - now) : 0;
+}
+
+
+struct NoisyLess {
+	bool operator()(const NoisyPath & a,const NoisyPath & b) const
+	{
+		return a.rate > b.rate;
+	}
+};
+
+size_t InotifyEventLoop::get_noisy(std::vector<NoisyPath> & noisy,size_t n)
+{
+	noisy.clear();
+	if(this->m_rate.window_ms == 0 || n == 0) {
+		return 0;
+	}
+
+	/* 按当前时间衰减后再比较，很久没有事件的节点不会排在前面 */
+	uint64_t now = monotonic_ms();
+	double window = this->m_rate.window_ms / 1000.0;
+	std::map<int,BlockNode*>::iterator iter;
+	for(iter = this->m_block_map.begin(); iter != this->m_block_map.end(); iter++)
+	{
+		const RateState & state = iter->second->rate_state;
+		if(state.rate_at == 0) {
+			continue;
+		}
+
+		NoisyPath item;
+		item.wd			= iter->first;
+		item.rate		= state.rate * exp(-(double)(now - state.rate_at) / 1000.0 / window);
+		item.dropped	= state.dropped;
+		item.downgraded	= state.downgrade_until != 0;
+		noisy.push_back(item);
+	}
+
+	std::map< std::pair<int,std::string>,RateState >::iterator child;
+	for(child = this->m_rate_children.begin(); child != this->m_rate_children.end(); child++)
+	{
+		NoisyPath item;
+		item.wd			= child->first.first;
+		item.name		= child->first.second;
+		item.rate		= child->second.rate * exp(-(double)(now - child->second.rate_at) / 1000.0 / window);
+		item.dropped	= child->second.dropped;
+		item.downgraded	= false;
+		noisy.push_back(item);
+	}
+
+	if(noisy.size() > n) {
+		std::partial_sort(noisy.begin(),noisy.begin() + n,noisy.end(),NoisyLess());
+		noisy.resize(n);
+	} else {
+		std::sort(noisy.begin(),noisy.end(),NoisyLess());
+	}
+
+	for(size_t i = 0; i < noisy.size(); i++)
+	{
+		this->get_path(noisy[i].wd,noisy[i].path);
+		noisy[i].path.append(noisy[i].name);
+	}
+
+	return noisy.size();
+}
+
+
+int InotifyEventLoop::read_event(EventRecordBatch & batch,int * exception)
+{
+	InotifyEvent * array[8192 / sizeof(struct InotifyEvent)];
+
+	/* 同一次读取的事件使用同一个时间戳，记录在 process_events 中逐个追加 */
+	EventRecordBatch::now(this->m_record_realtime,this->m_record_monotonic);
+	this->m_record_batch = &batch;
+	int number = this->read_event(array,sizeof(array) / sizeof(array[0]),exception);
+	this->m_record_batch = NULL;
+
+	return number;
+}
+
+
+int InotifyEventLoop::read_event(InotifyBatchIndex & index,int * /*exception*/,size_t buffer_size)
+{
+	index.clear();
+
+	/* 上一次没有处理完的事件还在缓冲区中，先为它们建立索引 */
+	char * buffer	= this->m_unread;
+	int count		= this->m_unread_len;
+	if(count <= 0) {
+		if(this->m_index_buffer.size() < buffer_size) {
+			this->m_index_buffer.resize(buffer_size);
+		}
+
+		buffer	= &this->m_index_buffer[0];
+		count	= this->m_ops->read(this->m_inotify_fd,buffer,buffer_size);
+		if ( count <= 0 ) {
+			this->m_error = errno;
+			return count;
+		}
+	}
+
+	/* 事件数量可能超过 process_events 的 uint16_t，分段处理 */
+	this->m_index_events.resize(count / sizeof(struct InotifyEvent) + 1);
+	int number = 0;
+	char * pbuf = buffer;
+	int left = count;
+	while(left > 0)
+	{
+		size_t room = this->m_index_events.size() - number;
+		if(room > 0xFFFF) {
+			room = 0xFFFF;
+		}
+
+		number += this->process_events(pbuf,left,&this->m_index_events[number],(uint16_t)room);
+		pbuf	= this->m_unread;
+		left	= this->m_unread_len;
+	}
+
+	/* 只为放行的事件建立索引 */
+	index.build(buffer,&this->m_index_events[0],number);
+	return number;
+}
+
+
+void  InotifyEventLoop::clear()
+{
+	BlockNode * node = NULL;
+	std::map<int,BlockNode*>::iterator iter;
+	for(iter = this->m_block_map.begin(); iter != this->m_block_map.end(); )
+	{
+		this->m_ops->rm_watch(this->m_inotify_fd,iter->first);
+		node = (BlockNode *)iter->second;
+		delete node;
+		this->m_block_map.erase(iter++);
+	}
+
+	this->m_roots.clear();
+	this->m_crawl_report.clear();
+	this->m_evicted.clear();
+	this->m_downgraded.clear();
+	this->m_rate_children.clear();
+	if(this->m_poller != NULL) {
+		this->m_poller->clear();
+	}
+	this->m_moved_from		= false;
+	this->m_moved_from_node	= NULL;
+	this->m_unread			= NULL;
+	this->m_unread_len		= 0;
+}
+
+int InotifyEventLoop::error() {
+	return this->m_error;
+}
+
+bool InotifyEventLoop::add_watch_file(const char * file,unsigned int events)
+{
+	return this->add_root(file,events,false) != -1;
+}
+
+bool InotifyEventLoop::add_watch_files(const char * files[],unsigned int size,unsigned int events)
+{
+	if(this->m_init != true) {
+		return false;
+	}
+
+	for(unsigned int i = 0; i < size && files[i] ; ++ i )
+	{
+		bool is_ok =  add_watch_file(files[i],events);
+		if(is_ok == false ) {
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+bool InotifyEventLoop::add_watch_recursively( const  char * path,unsigned int events )
+{
+	return this->add_root(path,events,true) != -1;
+}
+
+int InotifyEventLoop::add_root(const char * path,unsigned int events,bool recursively,CrawlReport * report,int backend)
+{
+	if(path == NULL || this->m_init != true) {
+		return -1;
+	}
+
+	int type = this->is_dir(path);
+	if(type < 0 || (recursively && type != 1)) {
+		return -1;
+	}
+
+	WatchRoot root;
+	root.id				= ++this->m_next_root;
+	root.wd				= -1;
+	root.events			= events;
+	root.recursively	= recursively;
+	root.backend		= backend;
+	root.path			= path;
+
+	/* 轮询后端只支持目录，节点由 InotifyPoller 维护，不进入 m_block_map */
+	if(backend == INOTIFY_BACKEND_POLL) {
+		if(type != 1) {
+			return -1;
+		}
+
+		if(this->m_poller == NULL) {
+			this->m_poller = new InotifyPoller();
+		}
+
+		root.wd = this->m_poller->add_watch(path,events,recursively);
+		if(root.wd == -1) {
+			this->m_error = errno;
+			return -1;
+		}
+
+		this->m_roots.insert(std::pair<int,WatchRoot>(root.id,root));
+		return root.id;
+	}
+
+	this->m_roots.insert(std::pair<int,WatchRoot>(root.id,root));
+
+	std::list<int> roots;
+	roots.push_back(root.id);
+
+	/* 回滚时 report 恢复到添加之前的样子 */
+	size_t failed	= report != NULL ? report->failures.size() : 0;
+	unsigned watched	= report != NULL ? report->watched : 0;
+
+	int wd = -1;
+	bool is_ok = false;
+	if(recursively) {
+		is_ok = this->add_watch_block_file_recursively(INOTIFY_ROOT,path,path,events,roots,&wd,report);
+	} else {
+		wd = this->add_watch_block_file(INOTIFY_ROOT,path,path,events,type == 1,roots,NULL);
+		if(wd == -1) {
+			this->add_crawl_failure(report,INOTIFY_ROOT,-1,path,type == 1);
+		} else if(report != NULL) {
+			report->watched++;
+		}
+		is_ok = (wd != -1);
+	}
+
+	/* 容错模式下只要根本身添加成功就保留 */
+	if(report != NULL && wd != -1) {
+		is_ok = true;
+	}
+
+	this->m_roots[root.id].wd = wd;
+	if(is_ok == false) {
+		/* 回滚已经添加的部分，不留下半棵树；记录的失败项也随之失效，retry_crawl 无法重试 */
+		int error = this->m_error;
+		this->remove_root(root.id);
+		this->m_error = error;
+
+		if(report != NULL) {
+			report->failures.erase(report->failures.begin() + failed,report->failures.end());
+			report->watched = watched;
+		}
+		return -1;
+	}
+
+	return root.id;
+}
+
+bool InotifyEventLoop::remove_root(int root)
+{
+	std::map<int,WatchRoot>::iterator root_iter = this->m_roots.find(root);
+	if(root_iter == this->m_roots.end()) {
+		return false;
+	}
+
+	if(root_iter->second.backend == INOTIFY_BACKEND_POLL) {
+		if(this->m_poller != NULL) {
+			this->m_poller->remove_watch(root_iter->second.wd);
+		}
+		this->m_roots.erase(root_iter);
+		return true;
+	}
+
+	std::list<int> subtree;
+	if(root_iter->second.wd != -1) {
+		if(root_iter->second.recursively) {
+			this->watch_block_subtree(root_iter->second.wd,subtree);
+		} else {
+			subtree.push_back(root_iter->second.wd);
+		}
+	}
+	this->m_roots.erase(root_iter);
+
+	std::set<int> deleted;
+	std::list<int> survivors;
+	std::list<int>::iterator iter;
+	for(iter = subtree.begin(); iter != subtree.end(); iter++)
+	{
+		BlockNode * node = this->watch_block_search(*iter);
+		if(node == NULL || !node->has_root(root)) {
+			continue;
+		}
+
+		node->roots.remove(root);
+		if(node->roots.empty()) {
+			deleted.insert(node->wd);
+		} else {
+			survivors.push_back(node->wd);
+		}
+	}
+
+	/* 先在树完整的时候算出路径：父节点被删除的节点成为剩余根的顶点，事件变化的节点需要重新设置 */
+	std::list< std::pair<int,std::string> > detached;
+	std::list< std::pair<std::string,unsigned int> > remask;
+	for(iter = survivors.begin(); iter != survivors.end(); iter++)
+	{
+		BlockNode * node = this->watch_block_search(*iter);
+		unsigned int events = 0;
+		std::list<int>::iterator r;
+		for(r = node->roots.begin(); r != node->roots.end(); r++)
+		{
+			std::map<int,WatchRoot>::iterator found = this->m_roots.find(*r);
+			if(found != this->m_roots.end()) {
+				events |= found->second.events;
+			}
+		}
+
+		bool is_detached = deleted.count(node->parent_wd) > 0;
+		if(!is_detached && events == node->events) {
+			continue;
+		}
+
+		std::string path;
+		if(this->get_path(node->wd,path) == false) {
+			continue;
+		}
+
+		if(is_detached) {
+			detached.push_back(std::pair<int,std::string>(node->wd,path));
+		}
+
+		if(events != node->events) {
+			node->events = events;
+			remask.push_back(std::pair<std::string,unsigned int>(path,events));
+		}
+	}
+
+	std::set<int>::iterator del;
+	for(del = deleted.begin(); del != deleted.end(); del++)
+	{
+		BlockNode * node = this->watch_block_search(*del);
+		if(node != NULL) {
+			this->watch_block_delete(node);
+		}
+	}
+
+	std::list< std::pair<int,std::string> >::iterator det;
+	for(det = detached.begin(); det != detached.end(); det++)
+	{
+		BlockNode * node = this->watch_block_search(det->first);
+		if(node != NULL) {
+			node->parent_wd	= INOTIFY_ROOT;
+			node->name		= det->second;
+		}
+	}
+
+	std::list< std::pair<std::string,unsigned int> >::iterator mask;
+	for(mask = remask.begin(); mask != remask.end(); mask++)
+	{
+		this->m_ops->add_watch(this->m_inotify_fd,mask->first.c_str(),mask->second);
+	}
+
+	return true;
+}
+
+bool InotifyEventLoop::retry_crawl(CrawlReport & report)
+{
+	std::vector<CrawlFailure> failures;
+	failures.swap(report.failures);
+
+	std::vector<CrawlFailure>::iterator iter;
+	for(iter = failures.begin(); iter != failures.end(); iter++)
+	{
+		std::list<int> roots;
+		std::string path;
+
+		/* 已经监控但没有遍历完的目录：只遍历该目录，已有的节点直接共享 */
+		if(iter->wd != -1) {
+			BlockNode * node = this->watch_block_search(iter->wd);
+			unsigned int events = this->inherit_roots(node,roots);
+			if(roots.empty() || this->get_path(iter->wd,path) == false) {
+				continue;
+			}
+
+			this->add_watch_block_dir(iter->wd,path.c_str(),events,roots,&report);
+			continue;
+		}
+
+		BlockNode * parent = this->watch_block_search(iter->parent_wd);
+		unsigned int events = this->inherit_roots(parent,roots);
+		if(roots.empty() || this->get_path(*iter,path) == false) {
+			continue;
+		}
+
+		int type = this->is_dir(path.c_str());
+		if(type == 1) {
+			this->add_watch_block_file_recursively(iter->parent_wd,path.c_str(),iter->name.c_str(),events,roots,NULL,&report);
+		} else if(type == 0) {
+			if(this->add_watch_block_file(iter->parent_wd,path.c_str(),iter->name.c_str(),events,false,roots,NULL) == -1) {
+				this->add_crawl_failure(&report,iter->parent_wd,-1,iter->name.c_str(),false);
+			} else {
+				report.watched++;
+			}
+		} else if(this->m_error != ENOENT) {
+			this->add_crawl_failure(&report,iter->parent_wd,-1,iter->name.c_str(),iter->is_dir);
+		}
+	}
+
+	return report.failures.empty();
+}
+
+CrawlReport * InotifyEventLoop::get_crawl_report()
+{
+	return &this->m_crawl_report;
+}
+
+bool InotifyEventLoop::get_path(const CrawlFailure & failure,std::string & path)
+{
+	if(failure.wd != -1) {
+		return this->get_path(failure.wd,path);
+	}
+
+	if(failure.parent_wd == INOTIFY_ROOT) {
+		path = failure.name;
+		return true;
+	}
+
+	if(this->get_path(failure.parent_wd,path) == false) {
+		return false;
+	}
+
+	if(!path.empty() && path.at(path.length() -1) != '/') {
+		path.append("/");
+	}
+	path.append(failure.name);
+	return true;
+}
+
+void InotifyEventLoop::set_watch_budget(unsigned int budget,unsigned int cold_ms)
+{
+	this->m_watch_budget	= budget;
+	this->m_cold_ms			= cold_ms > INOTIFY_MIN_COLD_MS ? cold_ms : INOTIFY_MIN_COLD_MS;
+	this->m_evict_failed_at	= 0;
+
+	if(budget != 0 && this->m_block_map.size() > budget) {
+		this->evict_cold(monotonic_ms(),0);
+	}
+}
+
+int InotifyEventLoop::poll_evicted(std::vector<std::string> & changed)
+{
+	int number = 0;
+	std::vector<EvictedDir> hot;
+	std::list<EvictedDir>::iterator iter;
+	for(iter = this->m_evicted.begin(); iter != this->m_evicted.end(); )
+	{
+		std::string path;
+		BlockNode * parent = this->watch_block_search(iter->parent_wd);
+		if(parent == NULL || this->get_path(iter->parent_wd,path) == false ||
+			this->get_child_wd(parent,iter->name) != -1) {
+			/* 父目录已经不在监控中，或者已经通过其他途径重新监控 */
+			this->m_evicted.erase(iter++);
+			continue;
+		}
+
+		if(!path.empty() && path.at(path.length() -1) != '/') {
+			path.append("/");
+		}
+		path.append(iter->name);
+		path.append("/");
+
+		bool is_changed = false;
+		bool is_gone	= false;
+		std::vector<EvictedDir::DirStat>::iterator dir;
+		for(dir = iter->dirs.begin(); dir != iter->dirs.end() && !is_gone; )
+		{
+			struct stat64 my_stat;
+			if(-1 == stat64( (path + dir->rel).c_str(), &my_stat)) {
+				/* 子目录被删除后不再轮询 */
+				is_changed = true;
+				is_gone = dir->rel.empty();
+				dir = iter->dirs.erase(dir);
+				continue;
+			}
+
+			if(my_stat.st_mtim.tv_sec != dir->mtime_sec || my_stat.st_mtim.tv_nsec != dir->mtime_nsec) {
+				dir->mtime_sec	= my_stat.st_mtim.tv_sec;
+				dir->mtime_nsec	= my_stat.st_mtim.tv_nsec;
+				is_changed = true;
+			}
+			dir++;
+		}
+
+		if(is_changed == false) {
+			iter++;
+			continue;
+		}
+
+		changed.push_back(path);
+		number++;
+
+		if(is_gone == false) {
+			/* 父目录标记为活跃，之后的移出不会再把它连同这个子树一起移出 */
+			parent->last_active = monotonic_ms();
+			hot.push_back(*iter);
+		}
+		this->m_evicted.erase(iter++);
+	}
+
+	/* 变热的子树在预算允许时重新监控，否则继续轮询 */
+	std::vector<EvictedDir>::iterator evicted;
+	for(evicted = hot.begin(); evicted != hot.end(); evicted++)
+	{
+		if(this->m_watch_budget != 0 && this->m_block_map.size() + evicted->watches > this->m_watch_budget) {
+			this->evict_cold(monotonic_ms(),evicted->watches);
+		}
+
+		if(this->m_watch_budget != 0 && this->m_block_map.size() + evicted->watches > this->m_watch_budget) {
+			this->m_evicted.push_back(*evicted);
+			continue;
+		}
+
+		std::string path;
+		std::list<int> roots;
+		BlockNode * parent = this->watch_block_search(evicted->parent_wd);
+		unsigned int events = this->inherit_roots(parent,roots);
+		if(roots.empty() || this->get_path(evicted->parent_wd,path) == false) {
+			continue;
+		}
+
+		if(!path.empty() && path.at(path.length() -1) != '/') {
+			path.append("/");
+		}
+		path.append(evicted->name);
+
+		this->add_watch_block_file_recursively(evicted->parent_wd,path.c_str(),evicted->name.c_str(),
+											   events,roots,NULL,&this->m_crawl_report);
+	}
+
+	return number;
+}
+
+int InotifyEventLoop::poll_event(InotifyEvent * array[],uint16_t size)
+{
+	if(this->m_poller == NULL) {
+		return 0;
+	}
+
+	int number = this->m_poller->poll(array,size,monotonic_ms());
+
+	/* 轮询根的目录被删除后同时移除根 */
+	for(int i = 0; i < number; i++)
+	{
+		if(!(array[i]->mask & IN_IGNORED)) {
+			continue;
+		}
+
+		std::map<int,WatchRoot>::iterator root;
+		for(root = this->m_roots.begin(); root != this->m_roots.end(); root++)
+		{
+			if(root->second.backend == INOTIFY_BACKEND_POLL && root->second.wd == array[i]->wd) {
+				this->m_roots.erase(root);
+				break;
+			}
+		}
+	}
+
+	return number;
+}
+
+int InotifyEventLoop::next_poll_timeout()
+{
+	if(this->m_poller == NULL) {
+		return -1;
+	}
+
+	return this->m_poller->next_timeout(monotonic_ms());
+}
+
+void InotifyEventLoop::set_poll_options(unsigned int min_interval_ms,unsigned int max_interval_ms,unsigned int threads)
+{
+	if(this->m_poller == NULL) {
+		this->m_poller = new InotifyPoller(min_interval_ms,max_interval_ms,threads);
+	} else {
+		this->m_poller->set_options(min_interval_ms,max_interval_ms,threads);
+	}
+}
+
+size_t InotifyEventLoop::get_watch_count()
+{
+	return this->m_block_map.size();
+}
+
+size_t InotifyEventLoop::get_evicted_count()
+{
+	return this->m_evicted.size();
+}
+
+const WatchRoot * InotifyEventLoop::get_root(int root)
+{
+	std::map<int,WatchRoot>::iterator iter = this->m_roots.find(root);
+	if(iter == this->m_roots.end()) {
+		return NULL;
+	}
+
+	return &iter->second;
+}
+
+bool InotifyEventLoop::get_overlap_roots(int root,std::list<int> & roots)
+{
+	const WatchRoot * self = this->get_root(root);
+	if(self == NULL) {
+		return false;
+	}
+
+	BlockNode * top = this->watch_block_search(self->wd);
+	std::map<int,WatchRoot>::iterator iter;
+	for(iter = this->m_roots.begin(); iter != this->m_roots.end(); iter++)
+	{
+		if(iter->first == root) {
+			continue;
+		}
+
+		/* 对方的顶点在 root 内，或者 root 的顶点在对方内 */
+		BlockNode * other = this->watch_block_search(iter->second.wd);
+		if( (other != NULL && other->has_root(root)) ||
+			(top != NULL && top->has_root(iter->first)) ) {
+			roots.push_back(iter->first);
+		}
+	}
+
+	return true;
+}
+
+bool InotifyEventLoop::get_roots(int wd,std::list<int> & roots,unsigned int mask)
+{
+	BlockNode * node = this->watch_block_search(wd);
+	if(node == NULL) {
+		return false;
+	}
+
+	mask &= IN_ALL_EVENTS;
+	std::list<int>::iterator iter;
+	for(iter = node->roots.begin(); iter != node->roots.end(); iter++)
+	{
+		std::map<int,WatchRoot>::iterator found = this->m_roots.find(*iter);
+		if(found != this->m_roots.end() && (mask == 0 || (found->second.events & mask) != 0)) {
+			roots.push_back(*iter);
+		}
+	}
+
+	return true;
+}
+
+int InotifyEventLoop::is_dir( char const * path ) 
+{
+	int ret = this->m_ops->is_dir(path);
+	if ( ret < 0 ) {
+		this->m_error = errno;
+	}
+
+	return ret;
+}
+
+void  InotifyEventLoop::remove_watch_wd(int wd)
+{
+	if(wd <= INOTIFY_POLL_WD) {
+		if(this->m_poller != NULL) {
+			this->m_poller->remove_watch(wd);
+		}
+
+		std::map<int,WatchRoot>::iterator root;
+		for(root = this->m_roots.begin(); root != this->m_roots.end(); root++)
+		{
+			if(root->second.backend == INOTIFY_BACKEND_POLL && root->second.wd == wd) {
+				this->m_roots.erase(root);
+				break;
+			}
+		}
+		return;
+	}
+
+	std::list<int> subtree;
+	this->watch_block_subtree(wd,subtree);
+	if(subtree.empty()) {
+		return;
+	}
+
+	/* 顶点在子树内的根一并移除 */
+	std::set<int> removed(subtree.begin(),subtree.end());
+	std::map<int,WatchRoot>::iterator root;
+	for(root = this->m_roots.begin(); root != this->m_roots.end(); )
+	{
+		if(removed.count(root->second.wd) > 0) {
+			this->m_roots.erase(root++);
+		} else {
+			root++;
+		}
+	}
+
+	std::list<int>::iterator iter;
+	for(iter = subtree.begin(); iter != subtree.end(); iter++)
+	{
+		BlockNode * node = watch_block_search(*iter);
+		if(node != NULL) {
+			this->watch_block_delete(node);
+		}
+	}
+}
+
+int InotifyEventLoop::get_child_wd(int wd,const char * name)
+{
+	if(name == NULL) {
+		return -1;
+	}
+
+	return this->get_child_wd(this->watch_block_search(wd),name);
+}
+
+bool InotifyEventLoop::get_parent(int wd,int & parent,std::string & name)
+{
+	BlockNode * node = this->watch_block_search(wd);
+	if(node == NULL || this->watch_block_search(node->parent_wd) == NULL) {
+		return false;
+	}
+
+	parent	= node->parent_wd;
+	name	= node->name;
+	return true;
+}
+
+int InotifyEventLoop::get_child_wd(BlockNode*node,std::string name)
+{
+	if(node == NULL) {
+		return -1;
+	}
+
+	std::list<int>::iterator iter;
+	for(iter = node->child.begin();iter != node->child.end(); iter++)
+	{
+		BlockNode*node = watch_block_search(*iter);
+		if(node == NULL) {
+			continue;
+		}
+
+		if( node->name == name )
+		{
 			return *iter;
 		}
 	}
@@ -473,6 +1489,10 @@ bool  InotifyEventLoop::get_path(int wd,std::string & path)
 	BlockNode * node  = NULL;
 	bool is_dir = false;
 
+	if(wd <= INOTIFY_POLL_WD) {
+		return this->m_poller != NULL && this->m_poller->get_path(wd,path);
+	}
+
 	node =  watch_block_search(wd);
 	if(node != NULL) {
 		is_dir = node->is_dir;
@@ -509,137 +1529,629 @@ bool  InotifyEventLoop::get_path(int wd,std::string & path)
 	return true;
 }
 
+int InotifyEventLoop::get_path(int wd,char * path,size_t size)
+{
+	if(wd <= INOTIFY_POLL_WD) {
+		std::string tmp;
+		if(this->m_poller == NULL || this->m_poller->get_path(wd,tmp) == false) {
+			return -1;
+		}
+		if(path != NULL && tmp.length() < size) {
+			memcpy(path,tmp.c_str(),tmp.length() + 1);
+		}
+		return (int)tmp.length();
+	}
+
+	BlockNode * node = watch_block_search(wd);
+	if(node == NULL) {
+		return -1;
+	}
+
+	/* 第一遍计算长度，规则与 get_path(int,std::string&) 相同 */
+	bool is_dir = node->is_dir;
+	size_t len = node->name.length();
+	if(is_dir && (node->name.empty() || node->name.at(node->name.length() -1) != '/')) {
+		len++;
+	}
+
+	BlockNode * child = node;
+	while(child->parent_wd != INOTIFY_ROOT)
+	{
+		BlockNode * parent = watch_block_search(child->parent_wd);
+		if(parent == NULL) {
+			return -1;
+		}
+		len += parent->name.length();
+		if(parent->name.empty() || parent->name.at(parent->name.length() -1) != '/') {
+			len++;
+		}
+		child = parent;
+	}
+
+	if(path == NULL || len >= size) {
+		return (int)len;
+	}
+
+	/* 第二遍从后往前填充 */
+	char * p = path + len;
+	*p = '\0';
+	if(is_dir && (node->name.empty() || node->name.at(node->name.length() -1) != '/')) {
+		*(--p) = '/';
+	}
+
+	child = node;
+	while(1)
+	{
+		p -= child->name.length();
+		memcpy(p,child->name.data(),child->name.length());
+		if(child->parent_wd == INOTIFY_ROOT) {
+			break;
+		}
+
+		BlockNode * parent = watch_block_search(child->parent_wd);
+		if(parent->name.empty() || parent->name.at(parent->name.length() -1) != '/') {
+			*(--p) = '/';
+		}
+		child = parent;
+	}
+
+	return (int)len;
+}
+
+void InotifyEventLoop::set_ops(InotifyOps * ops)
+{
+	this->m_ops = ops != NULL ? ops : InotifyOps::native();
+}
+
+InotifyOps * InotifyEventLoop::get_ops()
+{
+	return this->m_ops;
+}
+
+bool InotifyEventLoop::has_pending()
+{
+	return this->m_unread_len > 0;
+}
+
+char * InotifyEventLoop::get_pending(int & count)
+{
+	count = this->m_unread_len;
+	return count > 0 ? this->m_unread : NULL;
+}
+
+uint64_t InotifyEventLoop::get_read_seq()
+{
+	return this->m_read_seq;
+}
+
+#define TREE_VERSION	1
+
+void InotifyEventLoop::save_tree(std::string & out)
+{
+	out.clear();
+	tree_put32(out,TREE_VERSION);
+	tree_put32(out,(uint32_t)this->m_next_root);
+	tree_put32(out,(uint32_t)(this->m_moved_from_node != NULL ? this->m_moved_from_node->wd : -1));
+
+	tree_put32(out,(uint32_t)this->m_block_map.size());
+	std::map<int,BlockNode*>::iterator iter;
+	for(iter = this->m_block_map.begin(); iter != this->m_block_map.end(); iter++)
+	{
+		BlockNode * node = iter->second;
+		tree_put32(out,(uint32_t)node->wd);
+		tree_put32(out,(uint32_t)node->parent_wd);
+		tree_put32(out,node->events);
+		tree_put32(out,node->is_dir ? 1 : 0);
+		tree_put_str(out,node->name);
+
+		std::vector<int> sorted(node->child.begin(),node->child.end());
+		std::sort(sorted.begin(),sorted.end());
+		tree_put32(out,(uint32_t)sorted.size());
+		for(size_t i = 0; i < sorted.size(); i++)
+		{
+			tree_put32(out,(uint32_t)sorted[i]);
+		}
+
+		sorted.assign(node->roots.begin(),node->roots.end());
+		std::sort(sorted.begin(),sorted.end());
+		tree_put32(out,(uint32_t)sorted.size());
+		for(size_t i = 0; i < sorted.size(); i++)
+		{
+			tree_put32(out,(uint32_t)sorted[i]);
+		}
+	}
+
+	std::vector<const WatchRoot *> roots;
+	std::map<int,WatchRoot>::iterator root;
+	for(root = this->m_roots.begin(); root != this->m_roots.end(); root++)
+	{
+		if(root->second.backend == INOTIFY_BACKEND_INOTIFY) {
+			roots.push_back(&root->second);
+		}
+	}
+
+	tree_put32(out,(uint32_t)roots.size());
+	for(size_t i = 0; i < roots.size(); i++)
+	{
+		tree_put32(out,(uint32_t)roots[i]->id);
+		tree_put32(out,(uint32_t)roots[i]->wd);
+		tree_put32(out,roots[i]->events);
+		tree_put32(out,roots[i]->recursively ? 1 : 0);
+		tree_put_str(out,roots[i]->path);
+	}
+}
+
+bool InotifyEventLoop::load_tree(const char * data,size_t len)
+{
+	this->clear();
+	if(data == NULL) {
+		return false;
+	}
+
+	const char * p		= data;
+	const char * end	= data + len;
+	uint64_t now		= monotonic_ms();
+	uint32_t version,next_root,moved_from,count,value;
+	if(!tree_get32(p,end,version) || version != TREE_VERSION ||
+		!tree_get32(p,end,next_root) || !tree_get32(p,end,moved_from) || !tree_get32(p,end,count)) {
+		return false;
+	}
+
+	for(uint32_t i = 0; i < count; i++)
+	{
+		uint32_t wd,parent_wd,events,is_dir,children,roots;
+		std::string name;
+		if(!tree_get32(p,end,wd) || !tree_get32(p,end,parent_wd) || !tree_get32(p,end,events) ||
+			!tree_get32(p,end,is_dir) || !tree_get_str(p,end,name) || !tree_get32(p,end,children)) {
+			this->clear();
+			return false;
+		}
+
+		BlockNode * node = BlockNode::create((int)wd,(int)parent_wd,events,name.c_str(),is_dir != 0);
+		node->last_active = now;
+		if(this->m_block_map.insert(std::pair<int,BlockNode*>(node->wd,node)).second == false) {
+			delete node;
+			this->clear();
+			return false;
+		}
+
+		for(uint32_t n = 0; n < children; n++)
+		{
+			if(!tree_get32(p,end,value)) {
+				this->clear();
+				return false;
+			}
+			node->add_child((int)value);
+		}
+
+		if(!tree_get32(p,end,roots)) {
+			this->clear();
+			return false;
+		}
+		for(uint32_t n = 0; n < roots; n++)
+		{
+			if(!tree_get32(p,end,value)) {
+				this->clear();
+				return false;
+			}
+			node->add_root((int)value);
+		}
+	}
+
+	if(!tree_get32(p,end,count)) {
+		this->clear();
+		return false;
+	}
+
+	for(uint32_t i = 0; i < count; i++)
+	{
+		uint32_t id,wd,events,recursively;
+		WatchRoot root;
+		if(!tree_get32(p,end,id) || !tree_get32(p,end,wd) || !tree_get32(p,end,events) ||
+			!tree_get32(p,end,recursively) || !tree_get_str(p,end,root.path)) {
+			this->clear();
+			return false;
+		}
+
+		root.id				= (int)id;
+		root.wd				= (int)wd;
+		root.events			= events;
+		root.recursively	= recursively != 0;
+		root.backend		= INOTIFY_BACKEND_INOTIFY;
+		this->m_roots.insert(std::pair<int,WatchRoot>(root.id,root));
+	}
+
+	if((int)next_root > this->m_next_root) {
+		this->m_next_root = (int)next_root;
+	}
+
+	this->m_moved_from_node = this->watch_block_search((int)moved_from);
+	this->m_moved_from		= this->m_moved_from_node != NULL;
+	return true;
+}
+
+bool InotifyEventLoop::check_tree(std::string & error)
+{
+	char buf[256];
+	std::map<int,BlockNode*>::iterator iter;
+	for(iter = this->m_block_map.begin(); iter != this->m_block_map.end(); iter++)
+	{
+		BlockNode * node = iter->second;
+		if(node->wd != iter->first) {
+			snprintf(buf,sizeof(buf),"wd %d: stored under %d",node->wd,iter->first);
+			error = buf;
+			return false;
+		}
+
+		if(node->parent_wd != INOTIFY_ROOT) {
+			BlockNode * parent = this->watch_block_search(node->parent_wd);
+			if(parent == NULL || !parent->is_dir) {
+				snprintf(buf,sizeof(buf),"wd %d: parent %d is not a watched directory",node->wd,node->parent_wd);
+				error = buf;
+				return false;
+			}
+
+			if(std::count(parent->child.begin(),parent->child.end(),node->wd) != 1) {
+				snprintf(buf,sizeof(buf),"wd %d: not listed exactly once by parent %d",node->wd,node->parent_wd);
+				error = buf;
+				return false;
+			}
+		}
+
+		std::list<int>::iterator child;
+		for(child = node->child.begin(); child != node->child.end(); child++)
+		{
+			BlockNode * child_node = this->watch_block_search(*child);
+			if(child_node == NULL || child_node->parent_wd != node->wd) {
+				snprintf(buf,sizeof(buf),"wd %d: child %d is missing or has another parent",node->wd,*child);
+				error = buf;
+				return false;
+			}
+		}
+
+		std::list<int>::iterator root;
+		for(root = node->roots.begin(); root != node->roots.end(); root++)
+		{
+			if(this->m_roots.find(*root) == this->m_roots.end()) {
+				snprintf(buf,sizeof(buf),"wd %d: unknown root %d",node->wd,*root);
+				error = buf;
+				return false;
+			}
+		}
+
+		/* 沿父节点最多走 size 步，否则有环 */
+		BlockNode * up = node;
+		size_t steps = 0;
+		while(up != NULL && up->parent_wd != INOTIFY_ROOT && steps <= this->m_block_map.size())
+		{
+			up = this->watch_block_search(up->parent_wd);
+			steps++;
+		}
+		if(steps > this->m_block_map.size()) {
+			snprintf(buf,sizeof(buf),"wd %d: parent chain has a cycle",node->wd);
+			error = buf;
+			return false;
+		}
+	}
+
+	std::map<int,WatchRoot>::iterator root;
+	for(root = this->m_roots.begin(); root != this->m_roots.end(); root++)
+	{
+		if(root->second.backend != INOTIFY_BACKEND_INOTIFY) {
+			continue;
+		}
+
+		BlockNode * node = this->watch_block_search(root->second.wd);
+		if(node == NULL || !node->has_root(root->first)) {
+			snprintf(buf,sizeof(buf),"root %d: top wd %d is not watched by the root",root->first,root->second.wd);
+			error = buf;
+			return false;
+		}
+	}
+
+	if(this->m_moved_from_node != NULL && this->watch_block_search(this->m_moved_from_node->wd) != this->m_moved_from_node) {
+		error = "pending IN_MOVED_FROM node is not in the tree";
+		return false;
+	}
+
+	error.clear();
+	return true;
+}
+
 int InotifyEventLoop::get_inotify_fd()
 {
 	return this->m_inotify_fd;
 }
 
-bool InotifyEventLoop::add_watch_block_file_recursively(int parent,const char * path, unsigned int events)
-{
-		if(path == NULL || this->m_init != true || this->is_dir(path) != 1) {
-		return false;
-	}
+bool InotifyEventLoop::add_watch_block_file_recursively(int parent,const char * path,const char * name,unsigned int events,
+														const std::list<int> & roots,int * top_wd,CrawlReport * report)
+{
+	if(path == NULL || this->m_init != true || this->is_dir(path) != 1) {
+		return false;
+	}
+
+	bool descend = false;
+	int wd = add_watch_block_file(parent,path,name,events,true,roots,&descend);
+	if(top_wd != NULL) {
+		*top_wd = wd;
+	}
+	if(wd == -1) {
+		this->add_crawl_failure(report,parent,-1,name,true);
+		return false;
+	}
+
+	if(report != NULL) {
+		report->watched++;
+	}
+
+	/* 已经被其他根覆盖的子树不需要再遍历 */
+	if(descend == false) {
+		return true;
+	}
+
+	return add_watch_block_dir(wd,path,events,roots,report);
+}
+
+
+struct CrawlDir {
+	int							wd;
+	std::string					path;
+	std::vector<std::string>	files;
+	int							error;
+	bool						done;
+};
 
-	BlockNode * node 	= NULL;
-	static int first 	= 0;
-	int ret 			= -1;
-	DIR * dir 			= NULL;
-	int parent_wd_tmp 	= -1;
-	int parent_wd 		= -1;
+/* 遍历期间队列中的目录不会被 evict_cold 移出，遍历结束（包括出错返回）时解除 */
+struct CrawlPin {
+	CrawlPin(std::vector<int> & list) : wds(list) {}
+	~CrawlPin() { wds.clear(); }
 
-	std::string _dir 		= path;
-	std::stack<std::string> _stack;
-	std::stack<int>			_statck_parent_wd;
+	std::vector<int> &			wds;
+};
 
-	struct dirent * ent = NULL;
-	bool is_ok = false;
+bool InotifyEventLoop::add_watch_block_dir(int wd,const char * path,unsigned int events,const std::list<int> & roots,CrawlReport * report)
+{
+	int ret 			= -1;
+	bool descend		= false;
+	bool exhausted		= false;
+	bool is_ok			= true;
 
-	parent_wd = add_watch_block_file(parent,path,path,events,true);
-	if(parent_wd == -1) {
-		return false;
-	}
+	std::vector<DirEntry> entries;
 
-	_stack.push(_dir);
-	_statck_parent_wd.push(parent_wd);
+	/* 按层广度优先：先给所有目录添加监控，再按同样的顺序给文件添加监控 */
+	std::vector<CrawlDir> dirs;
+	CrawlDir top;
+	top.wd		= wd;
+	top.path	= path;
+	top.error	= 0;
+	top.done	= false;
+	dirs.push_back(top);
 
-	do {	
-		std::string file_tmp;
-		file_tmp = _stack.top();
-		_stack.pop();
+	CrawlPin pin(this->m_crawl_wds);
+	this->m_crawl_wds.push_back(wd);
 
-		parent_wd = _statck_parent_wd.top();
-		_statck_parent_wd.pop();
+	for(size_t i = 0; i < dirs.size() && !exhausted; i++)
+	{
+		std::string file_tmp = dirs[i].path;
+		int parent_wd = dirs[i].wd;
 
 		if( file_tmp.at(file_tmp.length() -1) != '/')
 		{
 			file_tmp.append("/");
 		}
+		dirs[i].path = file_tmp;
 		
-		dir = opendir(file_tmp.c_str());
-		if(dir == NULL) {
+		entries.clear();
+		if(-1 == this->m_ops->list_dir(file_tmp.c_str(),entries)) {
 			this->m_error = errno;
-			return false;
+			if(report == NULL) {
+				return false;
+			}
+			dirs[i].error = errno;
+			is_ok = false;
+			continue;
 		} 
 
-		while(1) {
+		for(size_t n = 0; n < entries.size() && !exhausted; n++) {
 			std::string tmp;
-			ent = readdir( dir );
-			if(ent != NULL) 
+			const char * name = entries[n].name.c_str();
+			switch(entries[n].type) 
 			{
-				switch(ent->d_type) 
-				{
-					case DT_REG:
-						tmp = file_tmp;
-						tmp.append(ent->d_name);
-						ret = add_watch_block_file(parent_wd,tmp.c_str(),ent->d_name,events,false);
-						if(ret == -1) {
+				case DT_REG:
+					dirs[i].files.push_back(entries[n].name);
+					break;
+
+				case DT_DIR:
+					tmp = file_tmp;
+					tmp.append(name);
+					if(tmp.at(tmp.length() -1) != '/') {
+						tmp.append("/");
+					}
+					ret = add_watch_block_file(parent_wd,tmp.c_str(),name,events,true,roots,&descend);
+					if(ret == -1) {
+						if(report == NULL) {
 							return false;
 						}
 
-						node = watch_block_search(parent_wd);
-						if(node != NULL) {
-							node->add_child(ret);
+						is_ok = false;
+						if(this->m_error == ENOSPC) {
+							/* 剩下的整个目录留给 retry_crawl */
+							exhausted = true;
+						} else {
+							this->add_crawl_failure(report,parent_wd,-1,name,true);
 						}
 						break;
+					}
 
-					case DT_DIR:
-						if( (0 != strcmp( ent->d_name, "." )) &&
-		     				(0 != strcmp( ent->d_name, ".." )) )
-						{
-							tmp = file_tmp;
-							tmp.append(ent->d_name);
-							if(tmp.at(tmp.length() -1) != '/') {
-								tmp.append("/");
-							}
-							_stack.push(tmp);
-							parent_wd_tmp = add_watch_block_file(parent_wd,tmp.c_str(),ent->d_name,events,true);
-							if(parent_wd_tmp == -1) {
-								return false;
-							}
-							_statck_parent_wd.push(parent_wd_tmp);
-
-							node = watch_block_search(parent_wd);
-							if(node != NULL) {
-								node->add_child(parent_wd_tmp);
-							}
-						}
-						break;
-					default: break;
+					if(report != NULL) {
+						report->watched++;
+					}
+
+					if(descend) {
+						CrawlDir sub;
+						sub.wd		= ret;
+						sub.path	= tmp;
+						sub.error	= 0;
+						sub.done	= false;
+						dirs.push_back(sub);
+						this->m_crawl_wds.push_back(ret);
+					}
+					break;
+				default: break;
+			}
+		}
+	}
+
+	for(size_t i = 0; i < dirs.size() && !exhausted; i++)
+	{
+		std::vector<std::string>::iterator iter;
+		for(iter = dirs[i].files.begin(); iter != dirs[i].files.end(); iter++)
+		{
+			std::string tmp = dirs[i].path;
+			tmp.append(*iter);
+			ret = add_watch_block_file(dirs[i].wd,tmp.c_str(),iter->c_str(),events,false,roots,NULL);
+			if(ret == -1) {
+				if(report == NULL) {
+					return false;
 				}
-			}else {
-				break;
+
+				is_ok = false;
+				if(this->m_error == ENOSPC) {
+					exhausted = true;
+					break;
+				}
+				this->add_crawl_failure(report,dirs[i].wd,-1,iter->c_str(),false);
+				continue;
+			}
+
+			if(report != NULL) {
+				report->watched++;
 			}
 		}
 
-		closedir(dir);
+		if(!exhausted && dirs[i].error == 0) {
+			dirs[i].done = true;
+		}
+		std::vector<std::string>().swap(dirs[i].files);
+	}
+
+	/* 没有遍历完的目录（包括打开失败的）整个记录为一项，重试时重新遍历 */
+	if(!is_ok && report != NULL) {
+		for(size_t i = 0; i < dirs.size(); i++)
+		{
+			if(dirs[i].done == false) {
+				BlockNode * node = this->watch_block_search(dirs[i].wd);
+				CrawlFailure failure;
+				failure.parent_wd	= node != NULL ? node->parent_wd : INOTIFY_ROOT;
+				failure.wd			= dirs[i].wd;
+				failure.error		= dirs[i].error != 0 ? dirs[i].error : ENOSPC;
+				failure.is_dir		= true;
+				failure.name		= node != NULL ? node->name : dirs[i].path;
+				report->failures.push_back(failure);
+			}
+		}
+	}
+
+	return is_ok;
+}
 
-	}while( !_stack.empty());
 
-	this->m_is_recursively = true;
+void InotifyEventLoop::add_crawl_failure(CrawlReport * report,int parent_wd,int wd,const char * name,bool is_dir)
+{
+	if(report == NULL) {
+		return;
+	}
 
-	return true;
+	CrawlFailure failure;
+	failure.parent_wd	= parent_wd;
+	failure.wd			= wd;
+	failure.error		= this->m_error;
+	failure.is_dir		= is_dir;
+	failure.name		= name;
+	report->failures.push_back(failure);
 }
 
 
-int InotifyEventLoop::add_watch_block_file(int parent_wd,const char * file,const char * name,unsigned int events,bool is_dir)
+int InotifyEventLoop::add_watch_block_file(int parent_wd,const char * file,const char * name,unsigned int events,bool is_dir,
+										   const std::list<int> & roots,bool * descend)
 {
 	if(file == NULL || this->m_init == false) {
 		return -1;
 	}
 
-	int wd = inotify_add_watch( this->m_inotify_fd, file, events);
+	/* 超出预算时先移出冷的子树，仍然不够则按 ENOSPC 处理 */
+	uint64_t now = monotonic_ms();
+	if(this->m_watch_budget != 0 && this->m_block_map.size() >= this->m_watch_budget) {
+		if(this->evict_cold(now,1) == false) {
+			this->m_error = ENOSPC;
+			return -1;
+		}
+	}
+
+	/* IN_MASK_ADD：与其他根共享同一个wd时不覆盖已有的事件 */
+	int wd = this->m_ops->add_watch( this->m_inotify_fd, file, events | IN_MASK_ADD);
 	if(wd < 0) {
 		this->m_error = errno;
 		return -1;
 	}
 
-	BlockNode * node = NULL;
+	std::list<int>::const_iterator iter;
+	BlockNode * node = this->watch_block_search(wd);
+	if(node != NULL) {
+		bool gained = false;
+		for(iter = roots.begin(); iter != roots.end(); iter++)
+		{
+			if(!node->has_root(*iter)) {
+				gained = true;
+				break;
+			}
+		}
+
+		/* 其他根的顶点出现在本次遍历中，挂到当前的父节点下 */
+		if(parent_wd != INOTIFY_ROOT && node->parent_wd == INOTIFY_ROOT && parent_wd != wd) {
+			BlockNode * parent_node = this->watch_block_search(parent_wd);
+			if(parent_node != NULL) {
+				node->parent_wd	= parent_wd;
+				node->name		= name;
+				parent_node->add_child(wd);
+			}
+		}
+
+		bool covered = is_dir && gained && this->is_covered(node,events);
+		if(covered) {
+			this->watch_block_tag(node,roots,events);
+		} else {
+			for(iter = roots.begin(); iter != roots.end(); iter++)
+			{
+				node->add_root(*iter);
+			}
+			node->events |= events;
+		}
+
+		if(descend != NULL) {
+			*descend = gained && !covered;
+		}
+		return wd;
+	}
+
 	node = BlockNode::create(wd,parent_wd,events,name,is_dir);
+	node->last_active = now;
 	bool is_ok = watch_block_insert(node);
 	if(is_ok == false) {
+		delete node;
+		this->m_ops->rm_watch(this->m_inotify_fd,wd);
+		this->m_error = ENOENT;
 		return -1;
 	}
 
+	node->roots = roots;
+	if(parent_wd != INOTIFY_ROOT) {
+		this->watch_block_search(parent_wd)->add_child(wd);
+	}
+
+	if(descend != NULL) {
+		*descend = true;
+	}
 	return wd;
 }
 
@@ -684,5 +2196,393 @@ BlockNode * InotifyEventLoop::watch_block_search(int wd)
 }
 
 
-}//namespace inotify
+void InotifyEventLoop::watch_block_delete(BlockNode* node)
+{
+	if(node->parent_wd != INOTIFY_ROOT) {
+		BlockNode * parent_node = this->watch_block_search(node->parent_wd);
+		if(parent_node != NULL) {
+			parent_node->child.remove(node->wd);
+		}
+	}
+
+	if(this->m_moved_from_node == node) {
+		this->m_moved_from_node = NULL;
+		this->m_moved_from		= false;
+	}
+
+	this->m_block_map.erase(node->wd);
+	this->m_ops->rm_watch(this->m_inotify_fd,node->wd);
+	delete node;
+}
+
+
+void InotifyEventLoop::watch_block_subtree(int wd,std::list<int> & subtree)
+{
+	BlockNode * node = this->watch_block_search(wd);
+	if(node == NULL) {
+		return;
+	}
+
+	/* 广度优先，subtree 本身作为队列 */
+	subtree.push_back(wd);
+	std::list<int>::iterator iter;
+	for(iter = subtree.begin(); iter != subtree.end(); iter++)
+	{
+		node = this->watch_block_search(*iter);
+		if(node == NULL) {
+			continue;
+		}
+
+		std::list<int>::iterator child;
+		for(child = node->child.begin(); child != node->child.end(); child++)
+		{
+			subtree.push_back(*child);
+		}
+	}
+}
+
+
+void InotifyEventLoop::watch_block_tag(BlockNode* node,const std::list<int> & roots,unsigned int events)
+{
+	std::list<int>::const_iterator iter;
+	for(iter = roots.begin(); iter != roots.end(); iter++)
+	{
+		node->add_root(*iter);
+	}
+
+	/* 只有递归的根会延伸到子树 */
+	std::list<int> recursive;
+	for(iter = roots.begin(); iter != roots.end(); iter++)
+	{
+		std::map<int,WatchRoot>::iterator found = this->m_roots.find(*iter);
+		if(found != this->m_roots.end() && found->second.recursively) {
+			recursive.push_back(*iter);
+		}
+	}
+
+	if(recursive.empty()) {
+		return;
+	}
+
+	std::list<int> subtree;
+	this->watch_block_subtree(node->wd,subtree);
+
+	std::list<int>::iterator wd;
+	for(wd = subtree.begin(); wd != subtree.end(); wd++)
+	{
+		BlockNode * child = this->watch_block_search(*wd);
+		for(iter = recursive.begin(); iter != recursive.end(); iter++)
+		{
+			child->add_root(*iter);
+		}
+		child->events |= events;
+	}
+}
+
+
+void InotifyEventLoop::watch_block_retag(BlockNode* node)
+{
+	std::list<int> subtree;
+	this->watch_block_subtree(node->wd,subtree);
+
+	/* 广度优先，父节点总是先于子节点重新计算 */
+	std::list<int>::iterator iter;
+	for(iter = subtree.begin(); iter != subtree.end(); iter++)
+	{
+		BlockNode * child = this->watch_block_search(*iter);
+		if(child == NULL) {
+			continue;
+		}
+
+		/* 以该节点为顶点的根保留，其余的根只能从新的父节点继承 */
+		std::list<int> roots;
+		this->inherit_roots(this->watch_block_search(child->parent_wd),roots);
+
+		std::list<int>::iterator r;
+		for(r = child->roots.begin(); r != child->roots.end(); r++)
+		{
+			std::map<int,WatchRoot>::iterator found = this->m_roots.find(*r);
+			if(found != this->m_roots.end() && found->second.wd == child->wd) {
+				roots.push_back(*r);
+			}
+		}
+
+		unsigned int events = 0;
+		child->roots.clear();
+		for(r = roots.begin(); r != roots.end(); r++)
+		{
+			child->add_root(*r);
+			events |= this->m_roots[*r].events;
+		}
+
+		if(events == child->events) {
+			continue;
+		}
+
+		child->events = events;
+		if(child->rate_state.downgrade_until != 0) {
+			events &= ~this->m_rate.downgrade_mask;
+		}
+
+		std::string path;
+		if(this->get_path(child->wd,path)) {
+			this->m_ops->add_watch(this->m_inotify_fd,path.c_str(),events);
+		}
+	}
+}
+
+
+unsigned InotifyEventLoop::inherit_roots(BlockNode* node,std::list<int> & roots)
+{
+	unsigned events = 0;
+	if(node == NULL) {
+		return events;
+	}
+
+	std::list<int>::iterator iter;
+	for(iter = node->roots.begin(); iter != node->roots.end(); iter++)
+	{
+		std::map<int,WatchRoot>::iterator found = this->m_roots.find(*iter);
+		if(found != this->m_roots.end() && found->second.recursively) {
+			roots.push_back(*iter);
+			events |= found->second.events;
+		}
+	}
+
+	return events;
+}
+
+
+bool InotifyEventLoop::is_covered(BlockNode* node,unsigned int events)
+{
+	std::list<int>::iterator iter;
+	for(iter = node->roots.begin(); iter != node->roots.end(); iter++)
+	{
+		std::map<int,WatchRoot>::iterator found = this->m_roots.find(*iter);
+		if(found != this->m_roots.end() && found->second.recursively &&
+			(found->second.events & events) == (events & ~IN_MASK_ADD)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+struct EvictCandidate {
+	int			wd;
+	uint64_t	last_active;	/* 子树中最后一次事件的时间 */
+	unsigned	size;			/* 子树的节点数量 */
+	bool		pinned;			/* 子树中有根的顶点，不能移出 */
+	int			parent;			/* 父节点在数组中的下标 */
+};
+
+static bool evict_candidate_less(const EvictCandidate & a,const EvictCandidate & b)
+{
+	if(a.last_active != b.last_active) {
+		return a.last_active < b.last_active;
+	}
+	return a.size > b.size;
+}
+
+
+bool InotifyEventLoop::evict_cold(uint64_t now,unsigned int need)
+{
+	if(this->m_watch_budget == 0) {
+		return true;
+	}
+
+	if(need > this->m_watch_budget) {
+		return false;
+	}
+
+	/* 上一次找不到可以移出的子树，短时间内不再重复扫描整棵树 */
+	if(this->m_evict_failed_at != 0 && now < this->m_evict_failed_at + 1000) {
+		return this->m_block_map.size() + need <= this->m_watch_budget;
+	}
+
+	/* 根的顶点、正在遍历的目录、还没有处理的事件所在的wd 都不能移出，祖先随之固定 */
+	std::set<int> pinned_wds(this->m_crawl_wds.begin(),this->m_crawl_wds.end());
+	std::map<int,WatchRoot>::iterator root;
+	for(root = this->m_roots.begin(); root != this->m_roots.end(); root++)
+	{
+		pinned_wds.insert(root->second.wd);
+	}
+
+	for(const char * p = this->m_pending; p != NULL && p < this->m_pending_end;)
+	{
+		const InotifyEvent * event = (const InotifyEvent *)p;
+		pinned_wds.insert(event->wd);
+		p += sizeof(struct InotifyEvent) + event->len;
+	}
+
+	/* 广度优先排列所有节点，再倒序汇总子树的活跃时间和大小 */
+	std::vector<EvictCandidate> nodes;
+	std::map<int,BlockNode*>::iterator iter;
+	for(iter = this->m_block_map.begin(); iter != this->m_block_map.end(); iter++)
+	{
+		if(iter->second->parent_wd == INOTIFY_ROOT) {
+			EvictCandidate top;
+			top.wd			= iter->first;
+			top.last_active	= iter->second->last_active;
+			top.size		= 1;
+			top.pinned		= true;
+			top.parent		= -1;
+			nodes.push_back(top);
+		}
+	}
+
+	for(size_t i = 0; i < nodes.size(); i++)
+	{
+		BlockNode * node = this->watch_block_search(nodes[i].wd);
+		std::list<int>::iterator child;
+		for(child = node->child.begin(); child != node->child.end(); child++)
+		{
+			BlockNode * child_node = this->watch_block_search(*child);
+			if(child_node == NULL) {
+				continue;
+			}
+
+			EvictCandidate candidate;
+			candidate.wd			= *child;
+			candidate.last_active	= child_node->last_active;
+			candidate.size			= 1;
+			candidate.pinned		= pinned_wds.count(*child) > 0;
+			candidate.parent		= (int)i;
+			nodes.push_back(candidate);
+		}
+	}
+
+	for(size_t i = nodes.size(); i > 0; i--)
+	{
+		EvictCandidate & node = nodes[i - 1];
+		if(node.parent < 0) {
+			continue;
+		}
+
+		EvictCandidate & parent = nodes[node.parent];
+		parent.size += node.size;
+		parent.pinned = parent.pinned || node.pinned;
+		if(node.last_active > parent.last_active) {
+			parent.last_active = node.last_active;
+		}
+	}
+
+	std::vector<EvictCandidate> candidates;
+	for(size_t i = 0; i < nodes.size(); i++)
+	{
+		BlockNode * node = this->watch_block_search(nodes[i].wd);
+		if(!nodes[i].pinned && node->is_dir && nodes[i].last_active + this->m_cold_ms <= now) {
+			candidates.push_back(nodes[i]);
+		}
+	}
+	std::sort(candidates.begin(),candidates.end(),evict_candidate_less);
+
+	/* 移出到预算的 90%，避免每添加一个wd就移出一次 */
+	size_t target = this->m_watch_budget - this->m_watch_budget / 10;
+	if(target > this->m_watch_budget - need) {
+		target = this->m_watch_budget - need;
+	}
+	std::vector<EvictCandidate>::iterator candidate;
+	for(candidate = candidates.begin(); candidate != candidates.end(); candidate++)
+	{
+		if(this->m_block_map.size() <= target) {
+			break;
+		}
+
+		/* 祖先已经被移出时节点已不存在 */
+		BlockNode * node = this->watch_block_search(candidate->wd);
+		if(node != NULL) {
+			this->evict_block_subtree(node);
+		}
+	}
+
+	if(this->m_block_map.size() + need > this->m_watch_budget) {
+		this->m_evict_failed_at = now;
+		return false;
+	}
+
+	this->m_evict_failed_at = 0;
+	return true;
+}
+
+
+void InotifyEventLoop::evict_block_subtree(BlockNode* node)
+{
+	std::string path;
+	if(this->get_path(node->wd,path) == false) {
+		return;
+	}
+
+	EvictedDir evicted;
+	evicted.parent_wd	= node->parent_wd;
+	evicted.name		= node->name;
+	evicted.watches		= 0;
+
+	/* 记录子树中所有目录的 mtime，wd -> 相对路径 */
+	std::list<int> subtree;
+	std::map<int,std::string> rel;
+	this->watch_block_subtree(node->wd,subtree);
+	rel[node->wd] = "";
+
+	std::list<int>::iterator iter;
+	for(iter = subtree.begin(); iter != subtree.end(); iter++)
+	{
+		BlockNode * sub = this->watch_block_search(*iter);
+		if(sub == NULL) {
+			continue;
+		}
+		evicted.watches++;
+
+		if(sub->wd != node->wd) {
+			rel[sub->wd] = rel[sub->parent_wd] + sub->name + "/";
+		}
+
+		if(sub->is_dir) {
+			struct stat64 my_stat;
+			if(-1 == stat64( (path + rel[sub->wd]).c_str(), &my_stat)) {
+				continue;
+			}
+
+			EvictedDir::DirStat dir;
+			dir.rel			= rel[sub->wd];
+			dir.mtime_sec	= my_stat.st_mtim.tv_sec;
+			dir.mtime_nsec	= my_stat.st_mtim.tv_nsec;
+			evicted.dirs.push_back(dir);
+		}
+	}
+
+	/* 子树中已经移出的子树合并到当前记录 */
+	std::list<EvictedDir>::iterator old;
+	for(old = this->m_evicted.begin(); old != this->m_evicted.end(); )
+	{
+		std::map<int,std::string>::iterator found = rel.find(old->parent_wd);
+		if(found == rel.end()) {
+			old++;
+			continue;
+		}
+
+		std::string prefix = found->second + old->name + "/";
+		std::vector<EvictedDir::DirStat>::iterator dir;
+		for(dir = old->dirs.begin(); dir != old->dirs.end(); dir++)
+		{
+			dir->rel = prefix + dir->rel;
+			evicted.dirs.push_back(*dir);
+		}
+		evicted.watches += old->watches;
+		this->m_evicted.erase(old++);
+	}
+
+	for(iter = subtree.begin(); iter != subtree.end(); iter++)
+	{
+		BlockNode * sub = this->watch_block_search(*iter);
+		if(sub != NULL) {
+			this->watch_block_delete(sub);
+		}
+	}
+
+	this->m_evicted.push_back(evicted);
+}
+
 
+}//namespace inotify
\ No newline at end of file
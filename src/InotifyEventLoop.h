@@ -13,6 +13,9 @@
 #include <string>
 #include <map>
 #include <list>
+#include <vector>
+#include <string.h>
+#include <errno.h>
 #include "EpollEvent.h"
 
 
@@ -66,9 +69,36 @@
 // 			 IN_MOVED_TO | IN_DELETE | IN_CREATE )
 
 #define INOTIFY_ROOT -9527
+#define INOTIFY_POLL_WD -10000      /* 轮询后端的wd从该值开始递减 */
+#define INOTIFY_MIN_COLD_MS 1000    /* set_watch_budget 的 cold_ms 下限 */
+
+/* 监控根使用的后端 */
+#define INOTIFY_BACKEND_INOTIFY     0
+#define INOTIFY_BACKEND_POLL        1   /* NFS、FUSE 等 inotify 看不到远端修改的文件系统 */
+
+/* 事件速率超出限制时的处理 */
+#define INOTIFY_RATE_NONE           0   /* 只统计速率 */
+#define INOTIFY_RATE_THROTTLE       1   /* 令牌桶，超出的事件丢弃 */
+#define INOTIFY_RATE_SAMPLE         2   /* 超出后每 sample 个事件放行一个 */
+#define INOTIFY_RATE_DOWNGRADE      3   /* 超出后重新设置wd的掩码，去掉 downgrade_mask 中的事件，冷却后恢复 */
+
+/* 会被限制的事件，新建、删除、改名等结构性事件始终放行 */
+#define INOTIFY_RATE_EVENTS     (IN_ACCESS | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CLOSE_NOWRITE | IN_OPEN)
 
 namespace inotify {
 
+struct RateState {
+    RateState() : rate(0), tokens(0), rate_at(0), dropped(0), sampled(0), downgrade_until(0) {}
+
+    double                      rate;           /* 衰减平均的事件速率 次/秒 */
+    double                      tokens;         /* 令牌桶中剩余的令牌 */
+    uint64_t                    rate_at;        /* 上一次更新 rate 和 tokens 的时间 ms，0 表示还没有事件 */
+    unsigned                    dropped;        /* 被限制丢弃的事件数 */
+    unsigned                    sampled;        /* INOTIFY_RATE_SAMPLE 的计数 */
+    uint64_t                    downgrade_until;/* 降级的恢复时间 ms，0 表示没有降级 */
+};
+
+
 struct BlockNode {
     static BlockNode * create(int wd,int parent_wd,unsigned int events,const char * name,bool is_dir)
     {
@@ -78,6 +108,7 @@ struct BlockNode {
         node->name      = name;
         node->is_dir    = is_dir;
         node->parent_wd = parent_wd;
+        node->last_active = 0;
         return node;
     }
 
@@ -86,15 +117,149 @@ struct BlockNode {
         this->child.push_back(child);
     }
 
+    bool  has_root(int root)
+    {
+        std::list<int>::iterator iter;
+        for(iter = this->roots.begin(); iter != this->roots.end(); iter++)
+        {
+            if( (*iter) == root ) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void  add_root(int root)
+    {
+        if(!this->has_root(root)) {
+            this->roots.push_back(root);
+        }
+    }
+
     int                         wd;
     int                         parent_wd;
     unsigned                    events;
     std::string                 name;
     bool                        is_dir;
     std::list<int>              child;
+    std::list<int>              roots;          /* 包含该节点的监控根 */
+    uint64_t                    last_active;    /* 最后一次事件（或添加）的时间 ms */
+    RateState                   rate_state;     /* wd 自身（不带 name）的事件 */
+};
+
+
+struct CrawlFailure {
+    int                         parent_wd;      /* 失败项所在目录的wd，根本身失败时为 INOTIFY_ROOT */
+    int                         wd;             /* 已经监控但没有遍历完的目录的wd，其他情况为 -1 */
+    int                         error;          /* errno */
+    bool                        is_dir;
+    std::string                 name;           /* 失败项的文件名，根本身失败时为完整路径 */
+};
+
+
+struct CrawlReport {
+    CrawlReport() : watched(0) {}
+
+    void  clear()
+    {
+        this->watched = 0;
+        this->failures.clear();
+    }
+
+    unsigned int                watched;        /* 成功添加（或共享）的wd数量 */
+    std::vector<CrawlFailure>   failures;
+};
+
+
+struct EvictedDir {
+    struct DirStat {
+        std::string             rel;            /* 相对被移出的目录的路径，顶层为 "" */
+        int64_t                 mtime_sec;
+        int64_t                 mtime_nsec;
+    };
+
+    int                         parent_wd;      /* 仍在监控中的父目录 */
+    std::string                 name;
+    unsigned int                watches;        /* 移出时子树占用的wd数量 */
+    std::vector<DirStat>        dirs;
 };
 
 
+struct WatchRoot {
+    int                         id;
+    int                         wd;             /* 根目录（文件）的wd */
+    unsigned                    events;
+    bool                        recursively;
+    int                         backend;        /* INOTIFY_BACKEND_INOTIFY / INOTIFY_BACKEND_POLL */
+    std::string                 path;
+};
+
+
+struct RateLimit {
+    RateLimit() : policy(INOTIFY_RATE_NONE), rate(100), burst(200), sample(100),
+                  downgrade_mask(IN_ACCESS | IN_MODIFY | IN_OPEN | IN_CLOSE_NOWRITE),
+                  cooldown_ms(10000), window_ms(0) {}
+
+    int                         policy;
+    double                      rate;           /* 每个节点允许的事件速率 次/秒 */
+    double                      burst;          /* 令牌桶的容量 */
+    unsigned                    sample;         /* INOTIFY_RATE_SAMPLE：每 sample 个放行一个 */
+    unsigned                    downgrade_mask; /* INOTIFY_RATE_DOWNGRADE：降级时去掉的事件 */
+    unsigned                    cooldown_ms;    /* INOTIFY_RATE_DOWNGRADE：降级的持续时间 */
+    unsigned                    window_ms;      /* 衰减平均的时间常数，0 关闭速率统计 */
+};
+
+
+struct NoisyPath {
+    int                         wd;
+    std::string                 name;           /* 目录上带 name 的事件的计数，为空时是 wd 自身的事件 */
+    double                      rate;           /* 次/秒 */
+    unsigned                    dropped;
+    bool                        downgraded;
+    std::string                 path;
+};
+
+
+struct DirEntry {
+    std::string                 name;
+    unsigned char               type;           /* readdir 的 d_type */
+};
+
+
+/*
+*   目录树维护用到的系统调用，默认直接调用内核（native）
+*   录制（InotifyRecorder）和回放（InotifyReplay）替换它，在没有 inotify fd 的情况下重现 read_event 的处理
+*/
+class InotifyOps
+{
+public:
+    virtual ~InotifyOps() {}
+
+    virtual int     init() = 0;
+    virtual int     read(int fd,char * buffer,size_t size) = 0;
+    virtual int     add_watch(int fd,const char * path,uint32_t mask) = 0;
+    virtual int     rm_watch(int fd,int wd) = 0;
+
+    /*
+    *   return:  1：目录  0：文件  -1：不存在  -2：其他错误，失败时设置 errno
+    */
+    virtual int     is_dir(const char * path) = 0;
+
+    /*
+    *   列出目录下的项，不包括 "." 和 ".."
+    *   return:  0 成功，-1 失败并设置 errno
+    */
+    virtual int     list_dir(const char * path,std::vector<DirEntry> & entries) = 0;
+
+    static InotifyOps * native();
+};
+
+
+class InotifyPoller;
+class EventRecordBatch;
+class InotifyBatchIndex;
+
+
 struct InotifyEvent {
 	int		        wd;		    /* watch descriptor */
 	uint32_t		mask;		/* watch mask */
@@ -121,12 +286,105 @@ public:
 
     /*
     *      array:  InotifyEvent的指针数组,  返回的 InotifyEvent指针不需要释放（切记）  input output
-    *       size:  指针数据的大小            input
+    *   array 装满时剩下的事件留在缓冲区中，has_pending 返回 true；这些事件已经从 fd 中读走，
+    *   epoll 等不会再通知，调用者需要一直调用 read_event 直到 has_pending 返回 false，再回到 epoll_wait
+    *      array:  InotifyEvent的指针数组,  返回的 InotifyEvent指针不需要释放（切记）  input output
+    *       size:  指针数据的大小，一次读到的事件更多时，剩下的留给下一次调用（不再读 fd）   input
     *  exception:  用于异常处理，待完善       output
     *     return:  返回读到的事件数量    成功： > 0   失败 <= 0     
     */
     int     read_event(InotifyEvent * array[], uint16_t size,int * exception);
 
+    /*
+    *   是否还有已经读到但没有返回的事件（read_event / read_event_as / read_event(EventRecordBatch &) 的 array 装满）
+    *     return:  true 需要继续调用 read_event，false 没有
+    */
+    bool    has_pending();
+
+    /*
+    *   读取事件并转换为拥有数据的 EventRecord 追加到 batch，带完整路径和时间戳
+    *   路径在每个事件的目录树维护之前解析，是事件发生时的路径（改名之前的事件得到旧路径）
+    *   被速率限制丢弃的事件不会记录；一次读到的事件超过内部数组时与 read_event 相同，需要按 has_pending 继续调用
+    *      batch:  事件记录       output
+    *  exception:  用于异常处理，待完善       output
+    *     return:  返回读到的事件数量    成功： > 0   失败 <= 0
+    */
+    int     read_event(EventRecordBatch & batch,int * exception);
+
+    /*
+    *   读取事件，完成目录树维护后为这一批放行的事件（被 set_rate_limit 丢弃的除外）建立 InotifyBatchIndex，由调用者按 mask / wd 过滤
+    *   使用单独的缓冲区，一次 read 可以取走内核队列中 buffer_size 字节以内的全部事件
+    *   索引指向内部缓冲区，下一次调用 read_event 后失效
+    *      index:  事件索引       output
+    *  exception:  用于异常处理，待完善       output
+    * buffer_size:  一次读取的最大字节数，至少要能放下一个最长的事件（sizeof(InotifyEvent) + NAME_MAX + 1）  input
+    *     return:  返回读到的事件数量    成功： > 0   失败 <= 0
+    */
+    int     read_event(InotifyBatchIndex & index,int * exception,size_t buffer_size = 64 * 1024);
+
+    /*
+    *   对已经读到的原始事件做目录树维护（新建目录的监控、改名、删除），read_event 读取后调用它
+    *   回放时直接传入录制的缓冲区
+    *     buffer:  inotify 原始事件        input
+    *      count:  字节数                  input
+    *      array:  InotifyEvent的指针数组，指向 buffer   output
+    *       size:  array 的大小，装满后停止，剩下的事件不做处理，由下一次 read_event 处理   input
+    *     return:  事件数量
+    */
+    int     process_events(char * buffer,int count,InotifyEvent * array[], uint16_t size);
+
+    /*
+    *   返回 array 装满后还没有处理的事件，回放等直接调用 process_events 的场合用它继续处理
+    *      count:  字节数，没有时为 0      output
+    *     return:  事件的起始位置，没有时返回 NULL
+    */
+    char *  get_pending(int & count);
+
+    /*
+    *   读取的序号，process_events 每处理一个新的缓冲区（一次 read）加 1，处理剩下的事件时不变
+    *   同一次读取的事件返回相同的值，可用于只在一批事件内有效的缓存
+    */
+    uint64_t get_read_seq();
+
+    /*
+    *   编译期特化的 read_event / process_events，返回的事件与通用版本相同
+    *   MASK 为所有根监控的事件的并集：内核不会发送 MASK 以外的事件，对应的分支在编译期去掉
+    *     RECURSIVE = false：没有递归根，不做新建、改名的目录树维护和路径解析，只处理 IN_DELETE_SELF
+    *     RECURSIVE = true ：只有 IN_CREATE / IN_MOVED_FROM / IN_MOVED_TO 才进入目录树维护
+    *   没有设置 set_watch_budget 时不更新节点的活跃时间
+    *   例： read_event_as<IN_CLOSE_WRITE,false>(array,size,&exception);
+    */
+    template <unsigned int MASK,bool RECURSIVE>
+    int     read_event_as(InotifyEvent * array[], uint16_t size,int * exception);
+
+    template <unsigned int MASK,bool RECURSIVE>
+    int     process_events_as(char * buffer,int count,InotifyEvent * array[], uint16_t size);
+
+    /*
+    *   替换系统调用，NULL 恢复为 native；需要在 init 之前设置，录制时可以在任意时候设置
+    */
+    void    set_ops(InotifyOps * ops);
+    InotifyOps * get_ops();
+
+    /*
+    *   目录树的快照（二进制，主机字节序），不包括轮询根和被移出监控的子树
+    *   节点按wd排序，子节点和根按id排序，同样的树得到同样的字节，可以直接比较
+    */
+    void    save_tree(std::string & out);
+
+    /*
+    *   从快照恢复目录树，不调用 add_watch；原有的树会被清空
+    *     return:  true 成功，fales 快照格式错误
+    */
+    bool    load_tree(const char * data,size_t len);
+
+    /*
+    *   检查目录树的一致性：父子关系双向一致、没有环、根和节点互相对应
+    *     error:  第一个不一致的描述     output
+    *    return:  true 一致
+    */
+    bool    check_tree(std::string & error);
+
     /*
     *    用于所有的监控wd的清理，会清空目录树，但不会close inotify fd
     *    清空后，可以继续添加目录或者文件进行监控
@@ -164,6 +422,152 @@ public:
     * */
     bool    add_watch_recursively( const char * path, unsigned int events);
 
+    /*
+    *   添加一个监控根，每个根有自己的监控事件，可以选择是否递归
+    *   与已有的根重叠（嵌套或相同）时共享已有的wd，已被递归根覆盖且事件包含在内的子树不会重复遍历
+    *   目录按层广度优先遍历，同一层先添加目录再添加文件，接近 max_user_watches 时优先保证上层目录
+    *           path:  文件名或目录       input
+    *         events:  监控的事件         input
+    *    recursively:  是否递归监控       input
+    *         report:  为 NULL 时遇到第一个错误即失败并回滚；
+    *                  不为 NULL 时跳过出错的项继续遍历，出错的项记录在 report 中，可用 retry_crawl 重试；
+    *                  根本身添加失败时仍然回滚，report 不保留这次添加记录的任何内容   output
+    *        backend:  INOTIFY_BACKEND_POLL 时以轮询的方式监控目录，事件通过 poll_event 返回   input
+    *         return:  根的id  成功：> 0  失败：-1
+    * */
+    int     add_root(const char * path, unsigned int events, bool recursively, CrawlReport * report = NULL,
+                     int backend = INOTIFY_BACKEND_INOTIFY);
+
+    /*
+    *   重试 report 中失败的项，已经成功的部分不会重新遍历；再次失败的项留在 report 中
+    *   父目录已经不在监控中或文件已经不存在的项会被丢弃
+    *     report:  add_root 或 get_crawl_report 返回的报告   input output
+    *     return:  true 全部成功，fales 仍有失败项
+    * */
+    bool    retry_crawl(CrawlReport & report);
+
+    /*
+    *   read_event 中自动添加新建目录时产生的失败项
+    * */
+    CrawlReport * get_crawl_report();
+
+    /*
+    *   返回失败项的完整路径
+    * */
+    bool    get_path(const CrawlFailure & failure,std::string & path);
+
+    /*
+    *   设置wd的预算，多个监控程序共享 max_user_watches 时使用
+    *   超出预算时，将最久没有事件的子树移出监控，改为轮询目录的 mtime，变化后再重新监控
+    *   正在遍历的目录和当前这批事件中还没有处理的wd不会被移出；
+    *   内核队列中还没有读出的事件不会更新活跃时间，因此 cold_ms 至少为 INOTIFY_MIN_COLD_MS，
+    *   调用者读取事件的间隔应当小于它
+    *   budget:  wd数量上限，0 不限制                        input
+    *  cold_ms:  超过多久没有事件的子树才会被移出，单位 ms     input
+    * */
+    void    set_watch_budget(unsigned int budget,unsigned int cold_ms = 60000);
+
+    /*
+    *   轮询被移出监控的目录，需要定时调用（例如 epoll_wait 超时）
+    *   目录的 mtime 变化（有文件新建、删除、改名）时返回该子树的路径，
+    *   预算允许时重新监控该子树，否则继续轮询
+    *   changed:  发生变化的子树路径     output
+    *    return:  发生变化的子树数量
+    * */
+    int     poll_evicted(std::vector<std::string> & changed);
+
+    /*
+    *   扫描到期的轮询根，返回与 read_event 相同格式的事件，wd 可以用 get_path 解析
+    *   返回的 InotifyEvent 指针在下一次调用 poll_event 前有效
+    *      array:  InotifyEvent的指针数组     output
+    *       size:  数组大小                    input
+    *     return:  事件数量
+    * */
+    int     poll_event(InotifyEvent * array[], uint16_t size);
+
+    /*
+    *   距离下一次需要调用 poll_event 的时间，可用作 epoll_wait 的超时
+    *     return:  ms，没有轮询根时返回 -1
+    * */
+    int     next_poll_timeout();
+
+    /*
+    *   设置轮询后端的最小、最大间隔（ms）和并行扫描的线程数
+    * */
+    void    set_poll_options(unsigned int min_interval_ms,unsigned int max_interval_ms,unsigned int threads);
+
+    /*
+    *   当前占用的wd数量
+    * */
+    size_t  get_watch_count();
+
+    /*
+    *   被移出监控、正在轮询的子树数量
+    * */
+    size_t  get_evicted_count();
+
+    /*
+    *   按节点统计事件速率，并限制单个高频文件（例如不停追加的日志）的事件，避免挤占其他事件
+    *   wd 自身的事件计在节点上；目录上带 name 的事件按 (wd, name) 单独计数，
+    *   与文件自身wd上的事件分开，一个高频的文件不会影响同一目录下的其他文件
+    *   INOTIFY_RATE_DOWNGRADE 只对文件的wd生效；目录和带 name 的事件超出后按 THROTTLE 丢弃，
+    *   目录不会因为其中一个文件而降级
+    *   只限制 INOTIFY_RATE_EVENTS 中的事件；read_event 的各个版本（包括 InotifyBatchIndex）都只返回放行的事件
+    *   limit.window_ms 为 0 时关闭统计和限制，已经降级的wd会被恢复
+    * */
+    void    set_rate_limit(const RateLimit & limit);
+
+    /*
+    *   恢复到期的降级wd，需要在 next_rate_timeout 到期时调用；read_event 处理每批事件前也会调用
+    *     return:  恢复的数量
+    * */
+    int     restore_downgraded();
+
+    /*
+    *   距离最早的降级恢复时间，可用作 epoll_wait 的超时
+    *     return:  ms，没有降级的wd时返回 -1
+    * */
+    int     next_rate_timeout();
+
+    /*
+    *   返回事件速率最高的 n 个节点，按速率从高到低
+    *      noisy:  节点信息      output
+    *          n:  最多返回的数量  input
+    *     return:  返回的数量
+    * */
+    size_t  get_noisy(std::vector<NoisyPath> & noisy,size_t n);
+
+    /*
+    *   移除一个监控根，只处理该根的子树：
+    *   不再属于任何根的节点会被移出监控，仍属于其他根的节点会按剩余根的事件重新设置
+    *       root:  根的id      input
+    *     return:  true 成功，fales 失败
+    * */
+    bool    remove_root(int root);
+
+    /*
+    *   返回根的信息，不存在时返回 NULL
+    * */
+    const WatchRoot * get_root(int root);
+
+    /*
+    *   返回与 root 重叠（包含 root 或被 root 包含）的其他根
+    *       root:  根的id        input
+    *      roots:  重叠的根id    output
+    *     return:  true 成功，fales 失败
+    * */
+    bool    get_overlap_roots(int root,std::list<int> & roots);
+
+    /*
+    *   返回包含 wd 的监控根：重叠的根共享同一个 wd，内核按各根事件的并集发送，
+    *   调用者用事件的 mask 过滤出真正监控该事件的根
+    *         wd:  事件的wd        input
+    *      roots:  根id           output
+    *       mask:  事件的 mask，只返回 events 包含其中事件的根；不含 IN_ALL_EVENTS 中的事件（IN_IGNORED 等）时返回全部根   input
+    *     return:  true 成功，fales wd 不在目录树中
+    * */
+    bool    get_roots(int wd,std::list<int> & roots,unsigned int mask = IN_ALL_EVENTS);
+
     /*
     *   判断文件是目录或者文件
     *       file:  文件名       input
@@ -172,7 +576,7 @@ public:
     int     is_dir(const char * path);
     
     /*
-    *       将wd移出监控
+    *       将wd以及wd下的子树移出监控
     *         wd:  事件的wd  input
     *       
     * */
@@ -186,6 +590,32 @@ public:
     * */
     bool    get_path(int wd,std::string & path);
 
+    /*
+    *   从目录树中返回 监控文件的完整路径，不分配内存
+    *        wd:  监控文件的wd          input
+    *      path:  输出的缓冲区，可以为 NULL   output
+    *      size:  缓冲区大小             input
+    *    return:  路径的长度（不包括 '\0'），缓冲区不够时只返回长度不写入；失败返回 -1
+    * */
+    int     get_path(int wd,char * path,size_t size);
+
+    /*
+    *   从目录树中查找目录下子文件的wd
+    *        wd:  目录的wd        input
+    *      name:  子文件名        input
+    *    return:  子文件的wd，没有监控时返回 -1
+    * */
+    int     get_child_wd(int wd,const char * name);
+
+    /*
+    *   get_child_wd 的反向查找，返回监控文件所在目录的wd和文件名
+    *        wd:  监控文件的wd        input
+    *    parent:  目录的wd           output
+    *      name:  文件名             output
+    *    return:  true 成功，fales wd 不存在或者父目录不在监控中（例如根本身）
+    * */
+    bool    get_parent(int wd,int & parent,std::string & name);
+
     /*
     *    返回inotify 的  fd ,可用于epoll 等多路IO 进行异步处理
     *   
@@ -196,11 +626,29 @@ public:
 
 private: 
     /* 内部 处理 */
-    bool        add_watch_block_file_recursively(int parent_wd,const char * path, unsigned int events);   
-    int         add_watch_block_file(int parent_wd,const char * file,const char * name,unsigned int events,bool is_dir);
+    bool        add_watch_block_file_recursively(int parent_wd,const char * path,const char * name,unsigned int events,
+                                                     const std::list<int> & roots,int * top_wd,CrawlReport * report);
+    bool        add_watch_block_dir(int wd,const char * path,unsigned int events,const std::list<int> & roots,CrawlReport * report);
+    void        add_crawl_failure(CrawlReport * report,int parent_wd,int wd,const char * name,bool is_dir);
+    int         add_watch_block_file(int parent_wd,const char * file,const char * name,unsigned int events,bool is_dir,
+                                     const std::list<int> & roots,bool * descend);
     int         get_child_wd(BlockNode*node,std::string name);
     bool        watch_block_insert(BlockNode* node);
     BlockNode * watch_block_search(int wd);
+    void        watch_block_delete(BlockNode* node);
+    void        watch_block_subtree(int wd,std::list<int> & subtree);
+    void        watch_block_tag(BlockNode* node,const std::list<int> & roots,unsigned int events);
+    void        watch_block_retag(BlockNode* node);
+    unsigned    inherit_roots(BlockNode* node,std::list<int> & roots);
+    void        flush_moved_from();
+    void        update_block(InotifyEvent * event,unsigned events,const std::list<int> & roots,std::string & path);
+    static uint64_t clock_ms();
+    bool        rate_admit(InotifyEvent * event,uint64_t now);
+    RateState * rate_child(int wd,const char * name,uint64_t now);
+    int         rate_restore(uint64_t now,bool all);
+    bool        is_covered(BlockNode* node,unsigned int events);
+    bool        evict_cold(uint64_t now,unsigned int need);
+    void        evict_block_subtree(BlockNode* node);
 
 private:
     int                             m_inotify_fd;
@@ -209,16 +657,127 @@ private:
 
     char                    *       m_event_buffer;
     uint16_t                        m_event_buffer_size;
+    char *                          m_unread;           /* array 装满后没有处理的事件，下一次 read_event 先处理 */
+    int                             m_unread_len;
+    uint64_t                        m_read_seq;
+    std::vector<char>               m_index_buffer;     /* read_event(InotifyBatchIndex &) 的缓冲区 */
+    std::vector<InotifyEvent *>     m_index_events;
 
-    bool                            m_is_recursively;
     bool 		                    m_moved_from;
     BlockNode *                     m_moved_from_node;
 
     std::map<int,BlockNode*>        m_block_map;
+    std::map<int,WatchRoot>         m_roots;
+    int                             m_next_root;
+    CrawlReport                     m_crawl_report;
+
+    unsigned int                    m_watch_budget;
+    unsigned int                    m_cold_ms;
+    uint64_t                        m_evict_failed_at;
+    std::vector<int>                m_crawl_wds;        /* 正在遍历的目录 */
+    const char *                    m_pending;          /* 当前这批事件中还没有处理的部分 */
+    const char *                    m_pending_end;
+    std::list<EvictedDir>           m_evicted;
+
+    RateLimit                       m_rate;
+    std::list<int>                  m_downgraded;
+    std::map< std::pair<int,std::string>,RateState >    m_rate_children;    /* 目录上带 name 的事件 */
+    size_t                          m_rate_prune_at;    /* m_rate_children 达到该数量时清理空闲的项 */
+
+    EventRecordBatch *              m_record_batch;     /* read_event(EventRecordBatch &) 期间逐个记录事件 */
+    uint64_t                        m_record_realtime;
+    uint64_t                        m_record_monotonic;
+
+    InotifyPoller *                 m_poller;
+    InotifyOps *                    m_ops;
     datacenter::Event*              m_epoll_event;
 };
 
 
+template <unsigned int MASK,bool RECURSIVE>
+int InotifyEventLoop::read_event_as(InotifyEvent * array[], uint16_t size,int * exception)
+{
+    if(this->m_unread_len > 0) {
+        return this->process_events_as<MASK,RECURSIVE>(this->m_unread,this->m_unread_len,array,size);
+    }
+
+    memset(this->m_event_buffer,0,this->m_event_buffer_size);
+    int count = this->m_ops->read(this->m_inotify_fd,this->m_event_buffer,this->m_event_buffer_size);
+    if(count <= 0) {
+        this->m_error = errno;
+        return count;
+    }
+
+    return this->process_events_as<MASK,RECURSIVE>(this->m_event_buffer,count,array,size);
+}
+
+
+template <unsigned int MASK,bool RECURSIVE>
+int InotifyEventLoop::process_events_as(char * buffer,int count,InotifyEvent * array[], uint16_t size)
+{
+    const bool track_moves  = RECURSIVE && (MASK & IN_MOVED_FROM) != 0;
+    const bool track_delete = (MASK & IN_DELETE_SELF) != 0;
+    const unsigned update   = RECURSIVE ? (MASK & (IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO)) : 0;
+
+    int number = 0;
+    std::string path;
+    std::list<int> roots;
+    if(buffer != this->m_unread) {
+        this->m_read_seq++;
+    }
+
+    uint64_t now = (this->m_watch_budget != 0 || this->m_rate.window_ms != 0) ? clock_ms() : 0;
+    if(!this->m_downgraded.empty()) {
+        this->rate_restore(now,false);
+    }
+
+    char * pbuf = buffer;
+    while(pbuf < buffer + count && number < size)
+    {
+        InotifyEvent * event = (InotifyEvent *)pbuf;
+        if(track_moves && this->m_moved_from && !(event->mask & IN_MOVED_TO)) {
+            this->flush_moved_from();
+        }
+
+        if(track_delete && (event->mask & IN_DELETE_SELF)) {
+            this->remove_watch_wd(event->wd);
+        }
+
+        if(now != 0 || (event->mask & update)) {
+            BlockNode * node = this->watch_block_search(event->wd);
+            if(node != NULL && now != 0) {
+                node->last_active = now;
+            }
+
+            if(event->mask & update) {
+                roots.clear();
+                unsigned events = this->inherit_roots(node,roots);
+                if(!roots.empty()) {
+                    this->m_pending     = pbuf;
+                    this->m_pending_end = buffer + count;
+                    this->update_block(event,events,roots,path);
+                    this->m_pending     = NULL;
+                }
+            }
+        }
+
+        if(this->m_rate.window_ms != 0 && this->rate_admit(event,now) == false) {
+            pbuf += sizeof(struct InotifyEvent) + event->len;
+            continue;
+        }
+
+        array[number] = event;
+        number++;
+
+        pbuf += sizeof(struct InotifyEvent) + event->len;
+    }
+
+    this->m_unread      = pbuf < buffer + count ? pbuf : NULL;
+    this->m_unread_len  = (int)(buffer + count - pbuf);
+    return number;
+}
+
+
 
 }//namespace inotify
 
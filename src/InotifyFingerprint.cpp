@@ -0,0 +1,499 @@
+#include "InotifyFingerprint.h"
+
+extern "C" {
+	#include <string.h>
+	#include <stdint.h>
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/types.h>
+	#include <sys/stat.h>
+}
+
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+#ifdef __FreeBSD__
+#define stat64 stat
+#define fstat64 fstat
+#endif
+
+#define FP_PRIME32_1	0x9E3779B1U
+#define FP_PRIME64_1	0x9E3779B185EBCA87ULL
+#define FP_PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define FP_PRIME64_3	0x165667B19E3779F9ULL
+
+#define FP_STRIPE_LEN		64		/* 每个 stripe 8 个 64 位 lane */
+#define FP_BLOCK_STRIPES	8		/* 每 8 个 stripe 做一次 scramble */
+
+/* 每个 stripe 使用 s_secret[n .. n+7]，n = stripe % FP_BLOCK_STRIPES */
+static const uint64_t s_secret[FP_BLOCK_STRIPES + 8] = {
+	0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+	0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+	0xcb00c391bb52283cULL, 0xa32e531b8b65d088ULL, 0x4ef90da297486471ULL, 0xd8acdea946ef1938ULL,
+	0x3f349ce33f76faa8ULL, 0x1d4f0bc7c7bbdcf9ULL, 0x3159b4cd4be0518aULL, 0x647378d9c97e9fc8ULL
+};
+
+static inline uint64_t fp_read64(const unsigned char * p)
+{
+	uint64_t v;
+	memcpy(&v,p,sizeof(v));
+	return v;
+}
+
+static inline uint64_t fp_avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= 0x165667919E3779F9ULL;
+	h ^= h >> 32;
+	return h;
+}
+
+/*
+ * acc[i]   += lo32(data[i] ^ key[i]) * hi32(data[i] ^ key[i])
+ * acc[i^1] += data[i]
+ */
+static inline void fp_accumulate(uint64_t * acc,const unsigned char * p,const uint64_t * key)
+{
+#if defined(__AVX2__)
+	for(int i = 0; i < 8; i += 4)
+	{
+		__m256i a	= _mm256_loadu_si256((const __m256i *)(acc + i));
+		__m256i d	= _mm256_loadu_si256((const __m256i *)(p + i * 8));
+		__m256i k	= _mm256_loadu_si256((const __m256i *)(key + i));
+		__m256i dk	= _mm256_xor_si256(d,k);
+		__m256i hi	= _mm256_shuffle_epi32(dk,_MM_SHUFFLE(0,3,0,1));
+		__m256i sw	= _mm256_shuffle_epi32(d,_MM_SHUFFLE(1,0,3,2));
+		a = _mm256_add_epi64(a,_mm256_add_epi64(_mm256_mul_epu32(dk,hi),sw));
+		_mm256_storeu_si256((__m256i *)(acc + i),a);
+	}
+#elif defined(__SSE2__)
+	for(int i = 0; i < 8; i += 2)
+	{
+		__m128i a	= _mm_loadu_si128((const __m128i *)(acc + i));
+		__m128i d	= _mm_loadu_si128((const __m128i *)(p + i * 8));
+		__m128i k	= _mm_loadu_si128((const __m128i *)(key + i));
+		__m128i dk	= _mm_xor_si128(d,k);
+		__m128i hi	= _mm_shuffle_epi32(dk,_MM_SHUFFLE(0,3,0,1));
+		__m128i sw	= _mm_shuffle_epi32(d,_MM_SHUFFLE(1,0,3,2));
+		a = _mm_add_epi64(a,_mm_add_epi64(_mm_mul_epu32(dk,hi),sw));
+		_mm_storeu_si128((__m128i *)(acc + i),a);
+	}
+#else
+	for(int i = 0; i < 8; i++)
+	{
+		uint64_t d	= fp_read64(p + i * 8);
+		uint64_t dk	= d ^ key[i];
+		acc[i ^ 1] += d;
+		acc[i]     += (dk & 0xFFFFFFFFULL) * (dk >> 32);
+	}
+#endif
+}
+
+static inline void fp_scramble(uint64_t * acc,const uint64_t * key)
+{
+	for(int i = 0; i < 8; i++)
+	{
+		uint64_t a = acc[i];
+		a ^= a >> 47;
+		a ^= key[i];
+		acc[i] = a * FP_PRIME32_1;
+	}
+}
+
+static void fp_init(uint64_t * acc,uint64_t seed)
+{
+	acc[0] = FP_PRIME32_1 ^ seed;
+	acc[1] = FP_PRIME64_1;
+	acc[2] = FP_PRIME64_2;
+	acc[3] = FP_PRIME64_3 + seed;
+	acc[4] = FP_PRIME64_1 - seed;
+	acc[5] = FP_PRIME32_1;
+	acc[6] = FP_PRIME64_2 ^ seed;
+	acc[7] = FP_PRIME64_3;
+}
+
+/*
+ * 累加 stripes 个完整的 stripe，first 是第一个 stripe 在整个数据中的序号，
+ * 分块读取时每块都是 stripe 的整数倍，逐块调用与一次调用的结果相同
+ */
+static void fp_update(uint64_t * acc,const unsigned char * p,size_t stripes,size_t first)
+{
+	for(size_t i = 0; i < stripes; i++)
+	{
+		size_t n = first + i;
+		fp_accumulate(acc,p + i * FP_STRIPE_LEN,s_secret + (n % FP_BLOCK_STRIPES));
+		if(n % FP_BLOCK_STRIPES == FP_BLOCK_STRIPES - 1) {
+			fp_scramble(acc,s_secret + FP_BLOCK_STRIPES);
+		}
+	}
+}
+
+/*
+ * 尾部不足一个 stripe 的数据补零后再累加一次，然后合并
+ */
+static uint64_t fp_final(uint64_t * acc,const unsigned char * tail,size_t rest,uint64_t len,uint64_t seed)
+{
+	if(rest > 0) {
+		unsigned char last[FP_STRIPE_LEN];
+		memset(last,0,sizeof(last));
+		memcpy(last,tail,rest);
+		fp_accumulate(acc,last,s_secret + FP_BLOCK_STRIPES - 1);
+	}
+
+	uint64_t result = len * FP_PRIME64_1 ^ seed;
+	for(int i = 0; i < 8; i += 2)
+	{
+		uint64_t lo = acc[i]     ^ s_secret[i + 1];
+		uint64_t hi = acc[i + 1] ^ s_secret[i + 2];
+		result += fp_avalanche(lo * (hi | 1) + (hi >> 29));
+	}
+
+	return fp_avalanche(result);
+}
+
+
+namespace inotify {
+
+InotifyFingerprint::InotifyFingerprint(InotifyEventLoop * loop,size_t chunk_size)
+{
+	/* 每块是 stripe 的整数倍 */
+	chunk_size -= chunk_size % FP_STRIPE_LEN;
+
+	this->m_loop		= loop;
+	this->m_chunk_size	= chunk_size > 0 ? chunk_size : FP_STRIPE_LEN;
+	this->m_seen_seq	= 0;
+	memset(&this->m_stats,0,sizeof(this->m_stats));
+}
+
+
+InotifyFingerprint::~InotifyFingerprint()
+{
+}
+
+
+bool InotifyFingerprint::changed(const InotifyEvent * event)
+{
+	if(event == NULL) {
+		return true;
+	}
+
+	if(event->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+		this->forget(event->wd);
+		return true;
+	}
+
+	if(event->len != 0 && (event->mask & (IN_DELETE | IN_MOVED_FROM))) {
+		this->m_files.erase(std::pair<int,std::string>(event->wd,event->name));
+		return true;
+	}
+
+	if((event->mask & IN_ISDIR) || !(event->mask & (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE))) {
+		return true;
+	}
+
+	std::string path;
+	if(this->resolve(event,path) == false) {
+		return true;
+	}
+
+	this->m_stats.checked++;
+
+	std::pair<int,std::string> key(event->wd,event->len != 0 ? event->name : "");
+	struct stat64 st;
+	if(-1 == stat64(path.c_str(),&st)) {
+		this->m_files.erase(key);
+		return true;
+	}
+
+	Fingerprint now;
+	now.dev			= st.st_dev;
+	now.ino			= st.st_ino;
+	now.size		= st.st_size;
+	now.mtime_sec	= st.st_mtim.tv_sec;
+	now.mtime_nsec	= st.st_mtim.tv_nsec;
+	now.hash		= 0;
+	now.hashed		= false;
+
+	/*
+	 * 一次写入的多个事件（文件自身的和父目录上带 name 的）在同一次读取中，只在同一次读取内按 inode 复用已经计算的 hash：
+	 * mtime 精度不足时，不同读取之间 size、mtime 相同也不能说明内容没有变化
+	 */
+	Fingerprint & cached = this->seen(now);
+	if(same_file(cached,now) && cached.hashed) {
+		now.hash	= cached.hash;
+		now.hashed	= true;
+	}
+	cached = now;
+
+	std::map< std::pair<int,std::string>,FileState >::iterator iter = this->m_files.find(key);
+	if(iter == this->m_files.end()) {
+		FileState file;
+		file.known = 0;
+		iter = this->m_files.insert(std::pair< std::pair<int,std::string>,FileState >(key,file)).first;
+	}
+
+	FileState & file = iter->second;
+	int n = channel(event);
+	Fingerprint & old = file.delivered[n];
+	bool is_known = (file.known & (1U << n)) != 0;
+	file.known |= 1U << n;
+
+	if(is_known == false || old.dev != now.dev || old.ino != now.ino || old.size != now.size) {
+		old = now;
+		return true;
+	}
+
+	bool same_mtime = (old.mtime_sec == now.mtime_sec && old.mtime_nsec == now.mtime_nsec);
+	if(same_mtime && !(event->mask & (IN_MODIFY | IN_CLOSE_WRITE))) {
+		/* 只有元数据变化 */
+		old = now;
+		this->m_stats.suppressed++;
+		return false;
+	}
+
+	/* size 相同，mtime 变化或者时间戳精度不足以区分：需要比较内容 */
+	if(now.hashed == false) {
+		if(this->hash_file(path.c_str(),now.size,now.hash) == false) {
+			old = now;
+			return true;
+		}
+		now.hashed	= true;
+		cached		= now;
+	}
+
+	bool is_changed = !(old.hashed && old.hash == now.hash);
+	old = now;
+
+	if(is_changed == false) {
+		this->m_stats.suppressed++;
+	}
+
+	return is_changed;
+}
+
+
+bool InotifyFingerprint::prime(int wd)
+{
+	std::string path;
+	if(this->m_loop == NULL || this->m_loop->get_path(wd,path) == false ||
+		path.empty() || path.at(path.length() - 1) == '/') {
+		return false;
+	}
+
+	struct stat64 st;
+	if(-1 == stat64(path.c_str(),&st)) {
+		return false;
+	}
+
+	Fingerprint fp;
+	fp.dev			= st.st_dev;
+	fp.ino			= st.st_ino;
+	fp.size			= st.st_size;
+	fp.mtime_sec	= st.st_mtim.tv_sec;
+	fp.mtime_nsec	= st.st_mtim.tv_nsec;
+	fp.hashed		= this->hash_file(path.c_str(),fp.size,fp.hash);
+	this->seen(fp) = fp;
+
+	/* 文件自身的事件，以及父目录上带 name 的事件 */
+	std::pair<int,std::string> keys[2];
+	int count = 0;
+	keys[count++] = std::pair<int,std::string>(wd,"");
+
+	int parent;
+	std::string name;
+	if(this->m_loop->get_parent(wd,parent,name)) {
+		keys[count++] = std::pair<int,std::string>(parent,name);
+	}
+
+	for(int i = 0; i < count; i++)
+	{
+		FileState & file = this->m_files[keys[i]];
+		for(int n = 0; n < FP_CHANNELS; n++)
+		{
+			file.delivered[n] = fp;
+		}
+		file.known = (1U << FP_CHANNELS) - 1;
+	}
+
+	return fp.hashed;
+}
+
+
+void InotifyFingerprint::forget(int wd)
+{
+	/* 文件自身以及目录下带 name 的项 */
+	std::map< std::pair<int,std::string>,FileState >::iterator first = this->m_files.lower_bound(std::pair<int,std::string>(wd,""));
+	std::map< std::pair<int,std::string>,FileState >::iterator last = first;
+	while(last != this->m_files.end() && last->first.first == wd)
+	{
+		last++;
+	}
+
+	this->m_files.erase(first,last);
+}
+
+
+const FingerprintStats & InotifyFingerprint::stats()
+{
+	return this->m_stats;
+}
+
+
+uint64_t InotifyFingerprint::hash(const void * data,size_t len,uint64_t seed)
+{
+	const unsigned char * p = (const unsigned char *)data;
+	uint64_t acc[8];
+	fp_init(acc,seed);
+
+	size_t stripes = len / FP_STRIPE_LEN;
+	fp_update(acc,p,stripes,0);
+
+	return fp_final(acc,p + stripes * FP_STRIPE_LEN,len - stripes * FP_STRIPE_LEN,len,seed);
+}
+
+
+bool InotifyFingerprint::resolve(const InotifyEvent * event,std::string & path)
+{
+	if(this->m_loop == NULL || this->m_loop->get_path(event->wd,path) == false || path.empty()) {
+		return false;
+	}
+
+	/* 目录的路径以 '/' 结尾：带 name 的事件拼上文件名，不带 name 的是目录自身的事件 */
+	bool is_dir = (path.at(path.length() - 1) == '/');
+	if(event->len == 0) {
+		return is_dir == false;
+	}
+
+	if(is_dir == false) {
+		return false;
+	}
+
+	path += event->name;
+	return true;
+}
+
+
+InotifyFingerprint::Fingerprint & InotifyFingerprint::seen(const Fingerprint & fp)
+{
+	/* 新的一次读取，之前的 hash 不再可信 */
+	uint64_t seq = this->m_loop->get_read_seq();
+	if(seq != this->m_seen_seq) {
+		this->m_seen.clear();
+		this->m_seen_seq = seq;
+	}
+
+	std::pair<uint64_t,uint64_t> key(fp.dev,fp.ino);
+	std::map< std::pair<uint64_t,uint64_t>,Fingerprint >::iterator iter = this->m_seen.find(key);
+	if(iter == this->m_seen.end()) {
+		Fingerprint none;
+		memset(&none,0,sizeof(none));
+		iter = this->m_seen.insert(std::pair< std::pair<uint64_t,uint64_t>,Fingerprint >(key,none)).first;
+	}
+
+	return iter->second;
+}
+
+
+bool InotifyFingerprint::hash_file(const char * path,int64_t size,uint64_t & hash)
+{
+	int fd = open(path,O_RDONLY);
+	if(fd == -1) {
+		return false;
+	}
+
+	struct stat64 st;
+	if(-1 == fstat64(fd,&st) || st.st_size != size) {
+		close(fd);
+		return false;
+	}
+
+	/*
+	 * 文件可能在读取的过程中被截断或改写：读到的字节不足时放弃，
+	 * 读完后 size、mtime 发生了变化时也放弃，由之后的事件重新判断
+	 */
+	uint64_t acc[8];
+	fp_init(acc,0);
+
+	std::vector<unsigned char> buffer((size_t)size < this->m_chunk_size ? (size_t)size : this->m_chunk_size);
+	int64_t offset = 0;
+	bool is_ok = true;
+	while(offset < size)
+	{
+		size_t want = buffer.size();
+		if((int64_t)want > size - offset) {
+			want = (size_t)(size - offset);
+		}
+
+		size_t total = 0;
+		while(total < want)
+		{
+			ssize_t n = pread(fd,&buffer[total],want - total,offset + total);
+			if(n < 0 && errno == EINTR) {
+				continue;
+			}
+			if(n <= 0) {
+				break;
+			}
+			total += n;
+		}
+
+		if(total != want) {
+			is_ok = false;
+			break;
+		}
+
+		size_t stripes = want / FP_STRIPE_LEN;
+		fp_update(acc,&buffer[0],stripes,(size_t)(offset / FP_STRIPE_LEN));
+		offset += want;
+
+		if(offset == size) {
+			hash = fp_final(acc,&buffer[stripes * FP_STRIPE_LEN],want - stripes * FP_STRIPE_LEN,size,0);
+		}
+	}
+
+	if(size == 0) {
+		hash = fp_final(acc,NULL,0,0,0);
+	}
+
+	struct stat64 after;
+	if(is_ok && (-1 == fstat64(fd,&after) || after.st_size != st.st_size ||
+		after.st_mtim.tv_sec != st.st_mtim.tv_sec || after.st_mtim.tv_nsec != st.st_mtim.tv_nsec)) {
+		is_ok = false;
+	}
+
+	close(fd);
+
+	if(is_ok) {
+		this->m_stats.hashed++;
+		this->m_stats.hashed_bytes += size;
+	}
+
+	return is_ok;
+}
+
+
+int InotifyFingerprint::channel(const InotifyEvent * event)
+{
+	if(event->mask & IN_CLOSE_WRITE) {
+		return 1;
+	}
+
+	return (event->mask & IN_MODIFY) ? 0 : 2;
+}
+
+
+bool InotifyFingerprint::same_file(const Fingerprint & a,const Fingerprint & b)
+{
+	return a.dev == b.dev && a.ino == b.ino && a.size == b.size &&
+		a.mtime_sec == b.mtime_sec && a.mtime_nsec == b.mtime_nsec;
+}
+
+
+}//namespace inotify
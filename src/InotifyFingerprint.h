@@ -0,0 +1,108 @@
+#ifndef __INOTIFY_FINGERPRINT_H__
+#define __INOTIFY_FINGERPRINT_H__
+
+
+/*
+    fingerprint
+    过滤内容没有变化的 IN_MODIFY / IN_ATTRIB / IN_CLOSE_WRITE 事件（touch、工具重写相同内容等）
+    按文件记录 size / mtime / inode，
+    只有 size、mtime 不足以判断时才计算内容 hash（xxh3 风格，SSE2/AVX2 加速），
+    大文件通过 pread 分块读取（文件可能同时被截断，mmap 访问截断部分会收到 SIGBUS）
+
+    文件自身的事件以 (wd, "") 为键，父目录上带 name 的事件以 (目录wd, name) 为键，不需要查找文件自身的 BlockNode；
+    每个键按事件类别（IN_MODIFY / IN_CLOSE_WRITE / IN_ATTRIB）分别记录最近一次放行时的状态，每个事件与同类事件上一次的状态比较
+    一次写入会产生多个事件（文件自身的 IN_MODIFY、IN_CLOSE_WRITE，以及父目录上带 name 的同样的事件），
+    同一次读取（InotifyEventLoop::get_read_seq）内按 inode 复用已经计算的 hash，一次写入最多计算一次；
+    不同读取之间总是重新计算（mtime 精度不足时，同样大小的两次改写可能有相同的 mtime）
+*/
+
+#include <map>
+#include "InotifyEventLoop.h"
+
+
+#define FP_CHANNELS             3       /* IN_MODIFY / IN_CLOSE_WRITE / IN_ATTRIB */
+
+
+namespace inotify {
+
+struct FingerprintStats {
+    uint64_t                    checked;        /* 检查的事件数量 */
+    uint64_t                    suppressed;     /* 被过滤掉的事件数量 */
+    uint64_t                    hashed;         /* 计算 hash 的次数 */
+    uint64_t                    hashed_bytes;   /* 计算 hash 的字节数 */
+};
+
+
+class InotifyFingerprint
+{
+public:
+    /*
+    *             loop:  用于 wd 到路径的解析           input
+    *       chunk_size:  超过该大小的文件分块读取，每块的大小   input
+    */
+    InotifyFingerprint(InotifyEventLoop * loop,size_t chunk_size = 64 * 1024);
+    ~InotifyFingerprint();
+
+public:
+    /*
+    *   判断事件对应的文件内容相对同类事件上一次是否发生了变化
+    *   目录上带 name 的事件用目录的路径拼上 name，IN_DELETE / IN_MOVED_FROM 时不再跟踪该 name
+    *      event:  read_event 读到的事件     input
+    *     return:  true 需要处理，false 内容没有变化，可以丢弃
+    */
+    bool    changed(const InotifyEvent * event);
+
+    /*
+    *   预先记录文件的指纹（包括内容 hash），之后第一次 touch 即可被过滤，父目录上带 name 的事件同样生效
+    *        wd:  文件的wd      input
+    *    return:  true 成功，fales 失败
+    */
+    bool    prime(int wd);
+
+    /*
+    *   不再跟踪 wd，以及 wd 为目录时其下带 name 的项
+    */
+    void    forget(int wd);
+
+    const FingerprintStats & stats();
+
+    /*
+    *   内容 hash，与 xxh3 同样的 stripe 累加结构，但不保证与 xxh3 的结果一致
+    */
+    static uint64_t hash(const void * data,size_t len,uint64_t seed = 0);
+
+private:
+    struct Fingerprint {
+        uint64_t                dev;
+        uint64_t                ino;
+        int64_t                 size;
+        int64_t                 mtime_sec;
+        int64_t                 mtime_nsec;
+        uint64_t                hash;
+        bool                    hashed;
+    };
+
+    struct FileState {
+        Fingerprint             delivered[FP_CHANNELS];     /* 每类事件最近一次的状态 */
+        unsigned int            known;                      /* 第 n 位为 1 表示 delivered[n] 有效 */
+    };
+
+    bool        resolve(const InotifyEvent * event,std::string & path);
+    Fingerprint & seen(const Fingerprint & fp);
+    bool        hash_file(const char * path,int64_t size,uint64_t & hash);
+    static int  channel(const InotifyEvent * event);
+    static bool same_file(const Fingerprint & a,const Fingerprint & b);
+
+private:
+    InotifyEventLoop *              m_loop;
+    size_t                          m_chunk_size;
+    FingerprintStats                m_stats;
+    std::map< std::pair<int,std::string>,FileState >        m_files;    /* (wd, "") 或 (目录wd, name) */
+    std::map< std::pair<uint64_t,uint64_t>,Fingerprint >    m_seen;     /* 本次读取中 stat 过的文件，以 (dev, ino) 为键 */
+    uint64_t                        m_seen_seq;
+};
+
+
+}//namespace inotify
+
+#endif
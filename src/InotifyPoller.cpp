@@ -0,0 +1,590 @@
+#include "InotifyPoller.h"
+
+extern "C" {
+	#include <sys/syscall.h>
+	#include <string.h>
+	#include <stdint.h>
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <pthread.h>
+	#include <sys/types.h>
+	#include <sys/stat.h>
+}
+
+#include <list>
+
+
+#ifdef __FreeBSD__
+#define stat64 stat
+#endif
+
+/* getdents64 的记录格式，glibc 旧版本没有导出 */
+struct linux_dirent64 {
+	uint64_t		d_ino;
+	int64_t			d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char			d_name[0];
+};
+
+
+namespace inotify {
+
+struct PollWorker {
+	std::vector<InotifyPoller::PollScan> *	scans;
+	size_t									first;
+	size_t									step;
+};
+
+static void * poll_worker_run(void * arg)
+{
+	PollWorker * worker = (PollWorker *)arg;
+	for(size_t i = worker->first; i < worker->scans->size(); i += worker->step)
+	{
+		InotifyPoller::scan_dir((*worker->scans)[i]);
+	}
+	return NULL;
+}
+
+
+InotifyPoller::InotifyPoller(unsigned int min_interval_ms,unsigned int max_interval_ms,unsigned int threads)
+{
+	this->m_next_wd		= INOTIFY_POLL_WD;
+	this->m_offset		= 0;
+	this->set_options(min_interval_ms,max_interval_ms,threads);
+}
+
+
+InotifyPoller::~InotifyPoller()
+{
+}
+
+
+int InotifyPoller::add_watch(const char * path,unsigned int events,bool recursively)
+{
+	if(path == NULL) {
+		return -1;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	uint64_t now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+	return this->add_dir(INOTIFY_ROOT,path,path,events,recursively,now);
+}
+
+
+void InotifyPoller::remove_watch(int wd)
+{
+	PollDir * dir = this->search(wd);
+	if(dir == NULL) {
+		return;
+	}
+
+	PollDir * parent = this->search(dir->parent_wd);
+	if(parent != NULL) {
+		std::map<std::string,PollEntry>::iterator entry = parent->entries.find(dir->name);
+		if(entry != parent->entries.end()) {
+			entry->second.wd = -1;
+		}
+	}
+
+	std::list<int> subtree;
+	subtree.push_back(wd);
+	while(!subtree.empty())
+	{
+		int tmp_wd = subtree.front();
+		subtree.pop_front();
+
+		dir = this->search(tmp_wd);
+		if(dir == NULL) {
+			continue;
+		}
+
+		std::map<std::string,PollEntry>::iterator iter;
+		for(iter = dir->entries.begin(); iter != dir->entries.end(); iter++)
+		{
+			if(iter->second.wd != -1) {
+				subtree.push_back(iter->second.wd);
+			}
+		}
+
+		this->m_dirs.erase(tmp_wd);
+	}
+}
+
+
+void InotifyPoller::clear()
+{
+	this->m_dirs.clear();
+	this->m_buffer.clear();
+	this->m_offset = 0;
+}
+
+
+int InotifyPoller::poll(InotifyEvent * array[],uint16_t size,uint64_t now_ms)
+{
+	if(this->m_offset >= this->m_buffer.size()) {
+		this->m_buffer.clear();
+		this->m_offset = 0;
+
+		std::vector<int> due;
+		std::vector<PollScan> scans;
+		std::map<int,PollDir>::iterator iter;
+		for(iter = this->m_dirs.begin(); iter != this->m_dirs.end(); iter++)
+		{
+			if(iter->second.next_due > now_ms) {
+				continue;
+			}
+
+			PollScan scan;
+			if(this->get_path(iter->first,scan.path) == false) {
+				continue;
+			}
+			scan.list		= (iter->second.events & (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE)) != 0;
+			scan.error		= 0;
+			scan.mtime_sec	= iter->second.mtime_sec;
+			scan.mtime_nsec	= iter->second.mtime_nsec;
+
+			due.push_back(iter->first);
+			scans.push_back(scan);
+		}
+
+		/* 扫描只涉及文件系统，可以并行；比较和产生事件在当前线程 */
+		size_t threads = this->m_threads < scans.size() ? this->m_threads : scans.size();
+		if(threads > 1) {
+			std::vector<PollWorker> workers(threads);
+			std::vector<pthread_t> tids(threads);
+			for(size_t i = 0; i < threads; i++)
+			{
+				workers[i].scans	= &scans;
+				workers[i].first	= i;
+				workers[i].step		= threads;
+			}
+
+			size_t started = 1;
+			for(size_t i = 1; i < threads; i++)
+			{
+				if(pthread_create(&tids[i],NULL,poll_worker_run,&workers[i]) != 0) {
+					break;
+				}
+				started++;
+			}
+
+			/* 线程创建失败时剩下的部分由当前线程完成 */
+			for(size_t i = started; i < threads; i++)
+			{
+				poll_worker_run(&workers[i]);
+			}
+			poll_worker_run(&workers[0]);
+
+			for(size_t i = 1; i < started; i++)
+			{
+				pthread_join(tids[i],NULL);
+			}
+		} else {
+			for(size_t i = 0; i < scans.size(); i++)
+			{
+				scan_dir(scans[i]);
+			}
+		}
+
+		for(size_t i = 0; i < due.size(); i++)
+		{
+			/* 前面的比较可能已经移除了这个目录 */
+			PollDir * dir = this->search(due[i]);
+			if(dir != NULL) {
+				this->diff(dir,scans[i],now_ms);
+			}
+		}
+	}
+
+	int number = 0;
+	while(number < size && this->m_offset < this->m_buffer.size())
+	{
+		InotifyEvent * event = (InotifyEvent *)&this->m_buffer[this->m_offset];
+		array[number] = event;
+		number++;
+		this->m_offset += sizeof(struct InotifyEvent) + event->len;
+	}
+
+	return number;
+}
+
+
+int InotifyPoller::next_timeout(uint64_t now_ms)
+{
+	if(this->m_offset < this->m_buffer.size()) {
+		return 0;
+	}
+
+	if(this->m_dirs.empty()) {
+		return -1;
+	}
+
+	uint64_t next = (uint64_t)-1;
+	std::map<int,PollDir>::iterator iter;
+	for(iter = this->m_dirs.begin(); iter != this->m_dirs.end(); iter++)
+	{
+		if(iter->second.next_due < next) {
+			next = iter->second.next_due;
+		}
+	}
+
+	return next <= now_ms ? 0 : (int)(next - now_ms);
+}
+
+
+bool InotifyPoller::get_path(int wd,std::string & path)
+{
+	std::vector<PollDir *> dirs;
+	PollDir * dir = this->search(wd);
+	while(dir != NULL)
+	{
+		dirs.push_back(dir);
+		if(dir->parent_wd == INOTIFY_ROOT) {
+			break;
+		}
+		dir = this->search(dir->parent_wd);
+	}
+
+	if(dir == NULL) {
+		return false;
+	}
+
+	for(size_t i = dirs.size(); i > 0; i--)
+	{
+		path += dirs[i - 1]->name;
+		if(path.empty() || path.at(path.length() -1) != '/') {
+			path.append("/");
+		}
+	}
+
+	return true;
+}
+
+
+void InotifyPoller::set_options(unsigned int min_interval_ms,unsigned int max_interval_ms,unsigned int threads)
+{
+	this->m_min_interval	= min_interval_ms > 0 ? min_interval_ms : 1;
+	this->m_max_interval	= max_interval_ms > this->m_min_interval ? max_interval_ms : this->m_min_interval;
+	this->m_threads			= threads > 0 ? threads : 1;
+}
+
+
+void InotifyPoller::scan_dir(PollScan & scan)
+{
+	struct stat64 my_stat;
+	if(-1 == stat64(scan.path.c_str(),&my_stat)) {
+		scan.error = errno;
+		return;
+	}
+
+	if(!S_ISDIR(my_stat.st_mode)) {
+		scan.error = ENOTDIR;
+		return;
+	}
+
+	/* 只关心新建/删除时，目录的 mtime 没有变化就不需要列目录 */
+	bool same = (my_stat.st_mtim.tv_sec == scan.mtime_sec && my_stat.st_mtim.tv_nsec == scan.mtime_nsec);
+	scan.mtime_sec	= my_stat.st_mtim.tv_sec;
+	scan.mtime_nsec	= my_stat.st_mtim.tv_nsec;
+	if(same && scan.list == false) {
+		return;
+	}
+	scan.list = true;
+
+	int fd = open(scan.path.c_str(),O_RDONLY | O_DIRECTORY);
+	if(fd == -1) {
+		scan.error = errno;
+		return;
+	}
+
+	char buffer[32768];
+	while(1)
+	{
+		long count = syscall(SYS_getdents64,fd,buffer,sizeof(buffer));
+		if(count < 0 && errno == EINTR) {
+			continue;
+		}
+		if(count <= 0) {
+			if(count < 0) {
+				scan.error = errno;
+			}
+			break;
+		}
+
+		for(long offset = 0; offset < count; )
+		{
+			struct linux_dirent64 * ent = (struct linux_dirent64 *)(buffer + offset);
+			offset += ent->d_reclen;
+
+			if( (0 == strcmp( ent->d_name, "." )) ||
+				(0 == strcmp( ent->d_name, ".." )) ) {
+				continue;
+			}
+
+			/* 列目录和 stat 之间文件被删除时忽略 */
+			struct stat64 st;
+			if(-1 == fstatat64(fd,ent->d_name,&st,AT_SYMLINK_NOFOLLOW)) {
+				continue;
+			}
+
+			PollEntry entry;
+			entry.ino			= st.st_ino;
+			entry.size			= st.st_size;
+			entry.mtime_sec		= st.st_mtim.tv_sec;
+			entry.mtime_nsec	= st.st_mtim.tv_nsec;
+			entry.ctime_sec		= st.st_ctim.tv_sec;
+			entry.ctime_nsec	= st.st_ctim.tv_nsec;
+			entry.mode			= st.st_mode;
+			entry.is_dir		= S_ISDIR(st.st_mode);
+			entry.wd			= -1;
+			scan.entries.insert(std::pair<std::string,PollEntry>(ent->d_name,entry));
+		}
+	}
+
+	close(fd);
+}
+
+
+InotifyPoller::PollDir * InotifyPoller::search(int wd)
+{
+	std::map<int,PollDir>::iterator iter = this->m_dirs.find(wd);
+	if(iter == this->m_dirs.end()) {
+		return NULL;
+	}
+
+	return &iter->second;
+}
+
+
+int InotifyPoller::add_dir(int parent_wd,const char * path,const char * name,unsigned int events,bool recursively,uint64_t now_ms)
+{
+	PollScan scan;
+	scan.path		= path;
+	scan.list		= true;
+	scan.error		= 0;
+	scan.mtime_sec	= 0;
+	scan.mtime_nsec	= 0;
+	scan_dir(scan);
+	if(scan.error != 0) {
+		return -1;
+	}
+
+	int top_wd = this->m_next_wd--;
+	std::list< std::pair<int,PollScan> > pending;
+	pending.push_back(std::pair<int,PollScan>(top_wd,scan));
+
+	PollDir dir;
+	dir.wd			= top_wd;
+	dir.parent_wd	= parent_wd;
+	dir.name		= name;
+	dir.events		= events;
+	dir.recursively	= recursively;
+	dir.interval	= this->m_min_interval;
+	dir.next_due	= now_ms + this->m_min_interval;
+	dir.mtime_sec	= 0;
+	dir.mtime_nsec	= 0;
+	this->m_dirs.insert(std::pair<int,PollDir>(top_wd,dir));
+
+	/* 广度优先建立快照，不产生事件 */
+	while(!pending.empty())
+	{
+		int wd = pending.front().first;
+		PollScan & current = pending.front().second;
+		PollDir * node = this->search(wd);
+
+		node->mtime_sec		= current.mtime_sec;
+		node->mtime_nsec	= current.mtime_nsec;
+		node->entries.swap(current.entries);
+
+		std::map<std::string,PollEntry>::iterator iter;
+		for(iter = node->entries.begin(); iter != node->entries.end() && recursively; iter++)
+		{
+			if(!iter->second.is_dir) {
+				continue;
+			}
+
+			PollScan sub;
+			sub.path		= current.path;
+			if(sub.path.at(sub.path.length() -1) != '/') {
+				sub.path.append("/");
+			}
+			sub.path.append(iter->first);
+			sub.list		= true;
+			sub.error		= 0;
+			sub.mtime_sec	= 0;
+			sub.mtime_nsec	= 0;
+			scan_dir(sub);
+			if(sub.error != 0) {
+				continue;
+			}
+
+			PollDir child = dir;
+			child.wd		= this->m_next_wd--;
+			child.parent_wd	= wd;
+			child.name		= iter->first;
+			this->m_dirs.insert(std::pair<int,PollDir>(child.wd,child));
+
+			iter->second.wd = child.wd;
+			pending.push_back(std::pair<int,PollScan>(child.wd,sub));
+		}
+
+		pending.pop_front();
+	}
+
+	return top_wd;
+}
+
+
+void InotifyPoller::diff(PollDir * dir,PollScan & scan,uint64_t now_ms)
+{
+	int wd = dir->wd;
+
+	if(scan.error != 0) {
+		if(scan.error == ENOENT || scan.error == ENOTDIR) {
+			/* 子目录的删除由父目录的扫描报告 */
+			if(dir->parent_wd == INOTIFY_ROOT) {
+				if(dir->events & IN_DELETE_SELF) {
+					this->push_event(wd,IN_DELETE_SELF,NULL);
+				}
+				this->push_event(wd,IN_IGNORED,NULL);
+			}
+			this->remove_watch(wd);
+			return;
+		}
+
+		dir->interval	= this->m_max_interval;
+		dir->next_due	= now_ms + dir->interval;
+		return;
+	}
+
+	bool changed = false;
+	if(scan.list) {
+		dir->mtime_sec	= scan.mtime_sec;
+		dir->mtime_nsec	= scan.mtime_nsec;
+
+		std::string path;
+		this->get_path(wd,path);
+
+		/* 两个有序的快照做归并比较 */
+		std::map<std::string,PollEntry>::iterator old_iter = dir->entries.begin();
+		std::map<std::string,PollEntry>::iterator new_iter = scan.entries.begin();
+		while(old_iter != dir->entries.end() || new_iter != scan.entries.end())
+		{
+			int cmp = 0;
+			if(old_iter == dir->entries.end()) {
+				cmp = 1;
+			} else if(new_iter == scan.entries.end()) {
+				cmp = -1;
+			} else {
+				cmp = old_iter->first.compare(new_iter->first);
+			}
+
+			PollEntry * removed = NULL;
+			PollEntry * created = NULL;
+			const char * name	= NULL;
+			if(cmp < 0) {
+				removed	= &old_iter->second;
+				name	= old_iter->first.c_str();
+			} else if(cmp > 0) {
+				created	= &new_iter->second;
+				name	= new_iter->first.c_str();
+			} else {
+				PollEntry & old_entry = old_iter->second;
+				PollEntry & new_entry = new_iter->second;
+				name = new_iter->first.c_str();
+				new_entry.wd = old_entry.wd;
+
+				if(old_entry.ino != new_entry.ino || old_entry.is_dir != new_entry.is_dir) {
+					removed = &old_entry;
+					created = &new_entry;
+					new_entry.wd = -1;
+				} else if(!new_entry.is_dir &&
+						  (old_entry.size != new_entry.size ||
+						   old_entry.mtime_sec != new_entry.mtime_sec || old_entry.mtime_nsec != new_entry.mtime_nsec)) {
+					uint32_t mask = (IN_MODIFY | IN_CLOSE_WRITE) & dir->events;
+					if(mask != 0) {
+						this->push_event(wd,mask,name);
+					}
+					changed = true;
+				} else if(old_entry.mode != new_entry.mode ||
+						  (!new_entry.is_dir &&
+						   (old_entry.ctime_sec != new_entry.ctime_sec || old_entry.ctime_nsec != new_entry.ctime_nsec))) {
+					if(dir->events & IN_ATTRIB) {
+						this->push_event(wd,IN_ATTRIB | (new_entry.is_dir ? IN_ISDIR : 0),name);
+					}
+					changed = true;
+				}
+			}
+
+			if(removed != NULL) {
+				if(dir->events & IN_DELETE) {
+					this->push_event(wd,IN_DELETE | (removed->is_dir ? IN_ISDIR : 0),name);
+				}
+				if(removed->wd != -1) {
+					int child_wd = removed->wd;
+					removed->wd = -1;
+					this->remove_watch(child_wd);
+				}
+				changed = true;
+			}
+
+			if(created != NULL) {
+				if(dir->events & IN_CREATE) {
+					this->push_event(wd,IN_CREATE | (created->is_dir ? IN_ISDIR : 0),name);
+				}
+				if(created->is_dir && dir->recursively) {
+					std::string sub = path + name;
+					created->wd = this->add_dir(wd,sub.c_str(),name,dir->events,true,now_ms);
+				}
+				changed = true;
+			}
+
+			if(cmp <= 0) {
+				old_iter++;
+			}
+			if(cmp >= 0) {
+				new_iter++;
+			}
+		}
+
+		dir->entries.swap(scan.entries);
+	}
+
+	/* 有变化的目录缩短间隔，没有变化时逐步加倍 */
+	if(changed) {
+		dir->interval = this->m_min_interval;
+	} else if(dir->interval < this->m_max_interval) {
+		dir->interval = dir->interval * 2 < this->m_max_interval ? dir->interval * 2 : this->m_max_interval;
+	}
+	dir->next_due = now_ms + dir->interval;
+}
+
+
+void InotifyPoller::push_event(int wd,uint32_t mask,const char * name)
+{
+	/* 与内核一样把 name 补齐到 InotifyEvent 大小的整数倍 */
+	uint32_t len = 0;
+	if(name != NULL) {
+		len = strlen(name) + 1;
+		len = (len + sizeof(struct InotifyEvent) - 1) / sizeof(struct InotifyEvent) * sizeof(struct InotifyEvent);
+	}
+
+	size_t offset = this->m_buffer.size();
+	this->m_buffer.resize(offset + sizeof(struct InotifyEvent) + len,0);
+
+	InotifyEvent * event = (InotifyEvent *)&this->m_buffer[offset];
+	event->wd		= wd;
+	event->mask		= mask;
+	event->cookie	= 0;
+	event->len		= len;
+	if(name != NULL) {
+		memcpy(event->name,name,strlen(name));
+	}
+}
+
+
+}//namespace inotify
@@ -0,0 +1,133 @@
+#ifndef __INOTIFY_POLLER_H__
+#define __INOTIFY_POLLER_H__
+
+
+/*
+    poller
+    inotify 看不到远端修改的文件系统（NFS、FUSE、overlay 的 lower 目录）的轮询后端
+    按目录 getdents64 + fstatat 比较前后两次的快照，产生与 InotifyEvent 相同格式的事件
+    每个目录的轮询间隔自适应：有变化的目录间隔缩短到最小值，没有变化时逐步加倍到最大值
+    同一轮到期的目录可以由多个线程并行扫描，比较和产生事件在调用线程中完成
+
+    wd 从 INOTIFY_POLL_WD 开始递减，与内核分配的 wd 不会冲突
+    可以检测到的事件：IN_CREATE IN_DELETE IN_MODIFY(同时带 IN_CLOSE_WRITE) IN_ATTRIB IN_DELETE_SELF
+    同一次轮询中的改名表现为 IN_DELETE + IN_CREATE
+*/
+
+#include <string>
+#include <map>
+#include <vector>
+#include "InotifyEventLoop.h"
+
+
+namespace inotify {
+
+class InotifyPoller
+{
+public:
+    /*
+    *   min_interval_ms:  最小轮询间隔 ms           input
+    *   max_interval_ms:  最大轮询间隔 ms           input
+    *           threads:  并行扫描的线程数，1 不创建线程   input
+    */
+    InotifyPoller(unsigned int min_interval_ms = 500,unsigned int max_interval_ms = 30000,unsigned int threads = 1);
+    ~InotifyPoller();
+
+public:
+    /*
+    *   添加一个轮询的目录，添加时建立快照，不产生事件
+    *           path:  目录                 input
+    *         events:  关心的事件           input
+    *    recursively:  是否轮询子目录       input
+    *         return:  目录的wd，失败返回 -1
+    */
+    int     add_watch(const char * path,unsigned int events,bool recursively);
+
+    /*
+    *   移除目录以及子目录的轮询
+    */
+    void    remove_watch(int wd);
+
+    void    clear();
+
+    /*
+    *   扫描到期的目录，返回产生的事件，一次没有取完的事件留到下次返回
+    *   返回的 InotifyEvent 指针在下一次调用 poll 前有效
+    *      array:  InotifyEvent的指针数组     output
+    *       size:  数组大小                    input
+    *     now_ms:  当前时间 ms（单调时钟）      input
+    *     return:  事件数量
+    */
+    int     poll(InotifyEvent * array[],uint16_t size,uint64_t now_ms);
+
+    /*
+    *   距离下一个目录到期的时间，可用作 epoll_wait 的超时
+    *     return:  ms，没有目录时返回 -1
+    */
+    int     next_timeout(uint64_t now_ms);
+
+    bool    get_path(int wd,std::string & path);
+
+    /*
+    *   修改轮询间隔和线程数，已有目录的间隔在下一次扫描后生效
+    */
+    void    set_options(unsigned int min_interval_ms,unsigned int max_interval_ms,unsigned int threads);
+
+public:
+    struct PollEntry {
+        uint64_t                ino;
+        int64_t                 size;
+        int64_t                 mtime_sec;
+        int64_t                 mtime_nsec;
+        int64_t                 ctime_sec;
+        int64_t                 ctime_nsec;
+        unsigned int            mode;
+        bool                    is_dir;
+        int                     wd;             /* 子目录的wd，没有轮询时为 -1 */
+    };
+
+    struct PollDir {
+        int                     wd;
+        int                     parent_wd;      /* 顶层为 INOTIFY_ROOT */
+        std::string             name;           /* 顶层为完整路径 */
+        unsigned int            events;
+        bool                    recursively;
+        unsigned int            interval;
+        uint64_t                next_due;
+        int64_t                 mtime_sec;
+        int64_t                 mtime_nsec;
+        std::map<std::string,PollEntry> entries;
+    };
+
+    struct PollScan {
+        std::string             path;
+        bool                    list;           /* 输入：是否强制列目录  输出：是否列了目录（mtime 没有变化时不列） */
+        int                     error;
+        int64_t                 mtime_sec;
+        int64_t                 mtime_nsec;
+        std::map<std::string,PollEntry> entries;
+    };
+
+    static void scan_dir(PollScan & scan);
+
+private:
+    PollDir *   search(int wd);
+    int         add_dir(int parent_wd,const char * path,const char * name,unsigned int events,bool recursively,uint64_t now_ms);
+    void        diff(PollDir * dir,PollScan & scan,uint64_t now_ms);
+    void        push_event(int wd,uint32_t mask,const char * name);
+
+private:
+    unsigned int                    m_min_interval;
+    unsigned int                    m_max_interval;
+    unsigned int                    m_threads;
+    int                             m_next_wd;
+
+    std::map<int,PollDir>           m_dirs;
+    std::vector<char>               m_buffer;       /* 与 read_event 相同格式的事件 */
+    size_t                          m_offset;       /* 尚未返回的事件的起始位置 */
+};
+
+
+}//namespace inotify
+
+#endif
@@ -0,0 +1,355 @@
+#include "InotifyRecord.h"
+
+extern "C" {
+	#include <string.h>
+	#include <stdlib.h>
+	#include <stdint.h>
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <time.h>
+	#include <sys/types.h>
+	#include <sys/stat.h>
+	#include <sys/mman.h>
+}
+
+
+#define EVENT_BATCH_HEADER_LEN		16
+#define EVENT_RECORD_HEADER_LEN		36
+#define EVENT_ALIGN(n)				(((n) + 7) & ~((size_t)7))
+
+static inline void put32(char * p,uint32_t v) { memcpy(p,&v,sizeof(v)); }
+static inline void put64(char * p,uint64_t v) { memcpy(p,&v,sizeof(v)); }
+static inline uint32_t get32(const char * p) { uint32_t v; memcpy(&v,p,sizeof(v)); return v; }
+static inline uint64_t get64(const char * p) { uint64_t v; memcpy(&v,p,sizeof(v)); return v; }
+
+
+namespace inotify {
+
+EventRecordBatch::EventRecordBatch(size_t block_size)
+{
+	this->m_block_size	= block_size > 0 ? block_size : 4096;
+	this->m_current		= 0;
+	this->m_used		= 0;
+}
+
+
+EventRecordBatch::~EventRecordBatch()
+{
+	for(size_t i = 0; i < this->m_blocks.size(); i++)
+	{
+		free(this->m_blocks[i]);
+	}
+}
+
+
+void EventRecordBatch::append(InotifyEventLoop * loop,const InotifyEvent * event,uint64_t realtime_ns,uint64_t monotonic_ns)
+{
+	EventRecord record;
+	record.wd			= event->wd;
+	record.mask			= event->mask;
+	record.cookie		= event->cookie;
+	record.realtime_ns	= realtime_ns;
+	record.monotonic_ns	= monotonic_ns;
+
+	size_t name_len = event->len > 0 ? strlen(event->name) : 0;
+	int dir_len = loop != NULL ? loop->get_path(event->wd,NULL,0) : -1;
+	if(dir_len < 0) {
+		dir_len = 0;
+	}
+
+	char * path = this->alloc(dir_len + name_len + 1);
+	if(dir_len > 0) {
+		loop->get_path(event->wd,path,dir_len + 1);
+	}
+	memcpy(path + dir_len,event->name,name_len);
+	path[dir_len + name_len] = '\0';
+
+	record.path		= path;
+	record.path_len	= dir_len + name_len;
+	this->m_records.push_back(record);
+}
+
+
+void EventRecordBatch::append(const EventRecord & record)
+{
+	char * path = this->alloc(record.path_len + 1);
+	memcpy(path,record.path,record.path_len);
+	path[record.path_len] = '\0';
+
+	this->m_records.push_back(record);
+	this->m_records.back().path = path;
+}
+
+
+size_t EventRecordBatch::size() const
+{
+	return this->m_records.size();
+}
+
+
+const EventRecord & EventRecordBatch::at(size_t i) const
+{
+	return this->m_records[i];
+}
+
+
+void EventRecordBatch::truncate(size_t size)
+{
+	if(size < this->m_records.size()) {
+		this->m_records.resize(size);
+	}
+}
+
+
+void EventRecordBatch::clear()
+{
+	this->m_records.clear();
+	this->m_current	= 0;
+	this->m_used	= 0;
+}
+
+
+size_t EventRecordBatch::serialize(std::string & out) const
+{
+	size_t bytes = 0;
+	for(size_t i = 0; i < this->m_records.size(); i++)
+	{
+		bytes += EVENT_ALIGN(EVENT_RECORD_HEADER_LEN + this->m_records[i].path_len + 1);
+	}
+
+	/* 一次分配，之后只做 memcpy */
+	size_t offset = out.size();
+	out.resize(offset + EVENT_BATCH_HEADER_LEN + bytes,'\0');
+	char * p = &out[offset];
+
+	put32(p,EVENT_BATCH_MAGIC);
+	uint16_t version = EVENT_BATCH_VERSION, reserved = 0;
+	memcpy(p + 4,&version,sizeof(version));
+	memcpy(p + 6,&reserved,sizeof(reserved));
+	put32(p + 8,(uint32_t)this->m_records.size());
+	put32(p + 12,(uint32_t)bytes);
+	p += EVENT_BATCH_HEADER_LEN;
+
+	for(size_t i = 0; i < this->m_records.size(); i++)
+	{
+		const EventRecord & record = this->m_records[i];
+		size_t len = EVENT_ALIGN(EVENT_RECORD_HEADER_LEN + record.path_len + 1);
+		put32(p,(uint32_t)len);
+		put32(p + 4,(uint32_t)record.wd);
+		put32(p + 8,record.mask);
+		put32(p + 12,record.cookie);
+		put64(p + 16,record.realtime_ns);
+		put64(p + 24,record.monotonic_ns);
+		put32(p + 32,record.path_len);
+		memcpy(p + EVENT_RECORD_HEADER_LEN,record.path,record.path_len);
+		p += len;
+	}
+
+	return EVENT_BATCH_HEADER_LEN + bytes;
+}
+
+
+bool EventRecordBatch::write(int fd) const
+{
+	std::string out;
+	this->serialize(out);
+
+	size_t total = 0;
+	while(total < out.size())
+	{
+		ssize_t n = ::write(fd,out.data() + total,out.size() - total);
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+		if(n <= 0) {
+			return false;
+		}
+		total += n;
+	}
+
+	return true;
+}
+
+
+size_t EventRecordBatch::parse(const char * data,size_t len)
+{
+	return this->parse(data,len,true);
+}
+
+
+size_t EventRecordBatch::parse_view(const char * data,size_t len)
+{
+	return this->parse(data,len,false);
+}
+
+
+void EventRecordBatch::now(uint64_t & realtime_ns,uint64_t & monotonic_ns)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME,&ts);
+	realtime_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	monotonic_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+char * EventRecordBatch::alloc(size_t size)
+{
+	while(this->m_current < this->m_blocks.size())
+	{
+		if(this->m_used + size <= this->m_block_sizes[this->m_current]) {
+			char * p = this->m_blocks[this->m_current] + this->m_used;
+			this->m_used += size;
+			return p;
+		}
+
+		this->m_current++;
+		this->m_used = 0;
+	}
+
+	size_t block_size = size > this->m_block_size ? size : this->m_block_size;
+	char * block = (char *)malloc(block_size);
+	this->m_blocks.push_back(block);
+	this->m_block_sizes.push_back(block_size);
+	this->m_current	= this->m_blocks.size() - 1;
+	this->m_used	= size;
+	return block;
+}
+
+
+size_t EventRecordBatch::parse(const char * data,size_t len,bool copy)
+{
+	if(data == NULL || len < EVENT_BATCH_HEADER_LEN || get32(data) != EVENT_BATCH_MAGIC) {
+		return 0;
+	}
+
+	uint16_t version;
+	memcpy(&version,data + 4,sizeof(version));
+	uint32_t count = get32(data + 8);
+	uint32_t bytes = get32(data + 12);
+	if(version != EVENT_BATCH_VERSION || len - EVENT_BATCH_HEADER_LEN < bytes) {
+		return 0;
+	}
+
+	const char * p		= data + EVENT_BATCH_HEADER_LEN;
+	const char * end	= p + bytes;
+	size_t first		= this->m_records.size();
+	for(uint32_t i = 0; i < count; i++)
+	{
+		if(end - p < EVENT_RECORD_HEADER_LEN) {
+			this->m_records.resize(first);
+			return 0;
+		}
+
+		uint32_t record_len = get32(p);
+		EventRecord record;
+		record.wd			= (int)get32(p + 4);
+		record.mask			= get32(p + 8);
+		record.cookie		= get32(p + 12);
+		record.realtime_ns	= get64(p + 16);
+		record.monotonic_ns	= get64(p + 24);
+		record.path_len		= get32(p + 32);
+		record.path			= p + EVENT_RECORD_HEADER_LEN;
+		/* 数据可能来自其他进程，path_len 在 size_t 下与 record_len 比较，防止溢出 */
+		if(record_len < EVENT_RECORD_HEADER_LEN + 1 || (size_t)(end - p) < record_len ||
+			(size_t)record.path_len > (size_t)record_len - EVENT_RECORD_HEADER_LEN - 1 ||
+			record.path[record.path_len] != '\0') {
+			this->m_records.resize(first);
+			return 0;
+		}
+
+		if(copy) {
+			this->append(record);
+		} else {
+			this->m_records.push_back(record);
+		}
+		p += record_len;
+	}
+
+	return EVENT_BATCH_HEADER_LEN + bytes;
+}
+
+
+EventJournal::EventJournal()
+{
+	this->m_data	= NULL;
+	this->m_size	= 0;
+	this->m_offset	= 0;
+}
+
+
+EventJournal::~EventJournal()
+{
+	this->close();
+}
+
+
+bool EventJournal::open(const char * file)
+{
+	this->close();
+
+	int fd = ::open(file,O_RDONLY);
+	if(fd == -1) {
+		return false;
+	}
+
+	struct stat st;
+	if(-1 == fstat(fd,&st)) {
+		::close(fd);
+		return false;
+	}
+
+	if(st.st_size > 0) {
+		void * addr = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+		if(addr == MAP_FAILED) {
+			::close(fd);
+			return false;
+		}
+		madvise(addr,st.st_size,MADV_SEQUENTIAL);
+		this->m_data = (char *)addr;
+		this->m_size = st.st_size;
+	}
+
+	::close(fd);
+	return true;
+}
+
+
+void EventJournal::close()
+{
+	if(this->m_data != NULL) {
+		munmap(this->m_data,this->m_size);
+	}
+
+	this->m_data	= NULL;
+	this->m_size	= 0;
+	this->m_offset	= 0;
+}
+
+
+bool EventJournal::next(EventRecordBatch & batch)
+{
+	if(this->m_data == NULL || this->m_offset >= this->m_size) {
+		return false;
+	}
+
+	/* parse_view 是追加的，每次只返回这一个批次 */
+	batch.clear();
+	size_t len = batch.parse_view(this->m_data + this->m_offset,this->m_size - this->m_offset);
+	if(len == 0) {
+		return false;
+	}
+
+	this->m_offset += len;
+	return true;
+}
+
+
+void EventJournal::rewind()
+{
+	this->m_offset = 0;
+}
+
+
+}//namespace inotify
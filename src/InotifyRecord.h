@@ -0,0 +1,159 @@
+#ifndef __INOTIFY_RECORD_H__
+#define __INOTIFY_RECORD_H__
+
+
+/*
+    record
+    read_event 返回的 InotifyEvent 指针指向内部缓冲区，下一次调用后失效
+    EventRecord 是拥有数据的事件记录，带完整路径和时间戳，路径保存在批次的 arena 中，不需要每个事件分配内存
+
+    二进制格式（主机字节序），一个批次：
+        batch header   magic(u32 'IEVB') version(u16) reserved(u16) count(u32) bytes(u32，后面记录的总长度)
+        record         len(u32，包括自身，8 字节对齐) wd(i32) mask(u32) cookie(u32)
+                       realtime_ns(u64) monotonic_ns(u64) path_len(u32) path(path_len 字节 + '\0'，补齐到 8 字节)
+    日志文件是批次的简单拼接，只追加；EventJournal 通过 mmap 读取，记录的 path 直接指向映射的内存
+*/
+
+#include <string>
+#include <vector>
+#include "InotifyEventLoop.h"
+
+
+#define EVENT_BATCH_MAGIC       0x42564549      /* "IEVB" */
+#define EVENT_BATCH_VERSION     1
+
+
+namespace inotify {
+
+struct EventRecord {
+    int                         wd;
+    uint32_t                    mask;
+    uint32_t                    cookie;
+    uint32_t                    path_len;       /* 不包括结尾的 '\0' */
+    uint64_t                    realtime_ns;    /* CLOCK_REALTIME */
+    uint64_t                    monotonic_ns;   /* CLOCK_MONOTONIC */
+    const char *                path;           /* 完整路径，以 '\0' 结尾 */
+};
+
+
+class EventRecordBatch
+{
+public:
+    /*
+    *   block_size:  arena 每块的大小      input
+    */
+    EventRecordBatch(size_t block_size = 64 * 1024);
+    ~EventRecordBatch();
+
+public:
+    /*
+    *   解析事件的完整路径并追加一条记录，路径无法解析时 path 为事件的 name（可能为空）
+    *   路径按调用时的目录树解析：在 read_event 返回后调用时，同一批中改名、删除之前的事件
+    *   会得到改名后的路径或者只有 name，需要事件发生时的路径请使用 read_event(EventRecordBatch &)
+    *         loop:  用于解析路径          input
+    *        event:  read_event 读到的事件  input
+    *  realtime_ns:  事件的时间戳           input
+    * monotonic_ns:  事件的时间戳           input
+    */
+    void    append(InotifyEventLoop * loop,const InotifyEvent * event,uint64_t realtime_ns,uint64_t monotonic_ns);
+
+    /*
+    *   追加一条记录，path 会复制到 arena
+    */
+    void    append(const EventRecord & record);
+
+    size_t  size() const;
+    const EventRecord & at(size_t i) const;
+
+    /*
+    *   只保留前 size 条记录，去掉的记录占用的 arena 在 clear 之前不回收
+    */
+    void    truncate(size_t size);
+
+    /*
+    *   清空记录，arena 的内存保留下来给下一批使用
+    */
+    void    clear();
+
+    /*
+    *   序列化为一个批次，追加到 out
+    *     return:  追加的字节数
+    */
+    size_t  serialize(std::string & out) const;
+
+    /*
+    *   序列化后一次 write 追加到 fd（例如以 O_APPEND 打开的日志文件或管道）
+    *     return:  true 成功，fales 失败
+    */
+    bool    write(int fd) const;
+
+    /*
+    *   从 data 解析一个批次，追加到本批次已有的记录之后，path 复制到本批次的 arena
+    *     return:  批次的总长度，数据不完整或格式错误时返回 0
+    */
+    size_t  parse(const char * data,size_t len);
+
+    /*
+    *   解析一个批次，path 直接指向 data，不复制；data 需要比本批次活得久
+    */
+    size_t  parse_view(const char * data,size_t len);
+
+    static void now(uint64_t & realtime_ns,uint64_t & monotonic_ns);
+
+private:
+    EventRecordBatch(const EventRecordBatch &);
+    EventRecordBatch & operator=(const EventRecordBatch &);
+
+    char *  alloc(size_t size);
+    size_t  parse(const char * data,size_t len,bool copy);
+
+private:
+    size_t                          m_block_size;
+    size_t                          m_current;      /* 当前使用的块 */
+    size_t                          m_used;         /* 当前块已用的字节数 */
+    std::vector<char *>             m_blocks;
+    std::vector<size_t>             m_block_sizes;
+    std::vector<EventRecord>        m_records;
+};
+
+
+class EventJournal
+{
+public:
+    EventJournal();
+    ~EventJournal();
+
+public:
+    /*
+    *   以只读 mmap 打开日志文件
+    *     return:  true 成功，fales 失败
+    */
+    bool    open(const char * file);
+    void    close();
+
+    /*
+    *   读取下一个批次，batch 原有的记录会被清空，记录的 path 指向映射的内存，在 close 之前有效
+    *   文件末尾不完整的批次（例如写入时崩溃）会被忽略
+    *     return:  true 读到批次，fales 没有更多的批次
+    */
+    bool    next(EventRecordBatch & batch);
+
+    /*
+    *   回到文件开头
+    */
+    void    rewind();
+
+private:
+    EventJournal(const EventJournal &);
+    EventJournal & operator=(const EventJournal &);
+
+private:
+    char *                          m_data;
+    size_t                          m_size;
+    size_t                          m_offset;
+};
+
+
+}//namespace inotify
+
+#endif
@@ -0,0 +1,521 @@
+#include "InotifyReplay.h"
+
+extern "C" {
+	#include <string.h>
+	#include <stdlib.h>
+	#include <stdint.h>
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <time.h>
+	#include <dirent.h>
+	#include <sys/types.h>
+	#include <sys/stat.h>
+	#include <sys/mman.h>
+}
+
+
+#define REPLAY_HEADER_LEN		8
+#define REPLAY_CHUNK_LEN		8
+#define REPLAY_ALIGN(n)			(((n) + 7) & ~((size_t)7))
+#define REPLAY_FLUSH_SIZE		(1024 * 1024)
+
+static inline uint32_t replay_get32(const char * p) { uint32_t v; memcpy(&v,p,sizeof(v)); return v; }
+
+static inline uint64_t replay_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+namespace inotify {
+
+InotifyRecorder::InotifyRecorder()
+{
+	this->m_loop	= NULL;
+	this->m_ops		= NULL;
+	this->m_fd		= -1;
+	this->m_failed	= false;
+}
+
+
+InotifyRecorder::~InotifyRecorder()
+{
+	this->stop();
+}
+
+
+bool InotifyRecorder::start(InotifyEventLoop * loop,const char * file)
+{
+	if(loop == NULL || file == NULL || this->m_loop != NULL) {
+		return false;
+	}
+
+	this->m_fd = ::open(file,O_WRONLY | O_CREAT | O_TRUNC,0644);
+	if(this->m_fd == -1) {
+		return false;
+	}
+
+	this->m_loop	= loop;
+	this->m_ops		= loop->get_ops();
+	this->m_failed	= false;
+	this->m_buffer.clear();
+
+	uint32_t header[2] = { REPLAY_MAGIC, REPLAY_VERSION };
+	this->m_buffer.append((const char *)header,sizeof(header));
+
+	std::string tree;
+	loop->save_tree(tree);
+	this->chunk(REPLAY_TREE,tree.data(),tree.size());
+
+	loop->set_ops(this);
+	return this->flush();
+}
+
+
+bool InotifyRecorder::stop()
+{
+	if(this->m_loop == NULL) {
+		return false;
+	}
+
+	this->m_loop->set_ops(this->m_ops);
+
+	std::string tree;
+	this->m_loop->save_tree(tree);
+	this->chunk(REPLAY_TREE_END,tree.data(),tree.size());
+	this->flush();
+
+	::close(this->m_fd);
+	this->m_fd		= -1;
+	this->m_loop	= NULL;
+	this->m_ops		= NULL;
+	return !this->m_failed;
+}
+
+
+int InotifyRecorder::init()
+{
+	return this->m_ops->init();
+}
+
+
+int InotifyRecorder::read(int fd,char * buffer,size_t size)
+{
+	int count = this->m_ops->read(fd,buffer,size);
+	if(count > 0) {
+		this->chunk(REPLAY_EVENTS,buffer,count);
+		if(this->m_buffer.size() >= REPLAY_FLUSH_SIZE) {
+			this->flush();
+		}
+	}
+	return count;
+}
+
+
+int InotifyRecorder::add_watch(int fd,const char * path,uint32_t mask)
+{
+	int wd = this->m_ops->add_watch(fd,path,mask);
+	int error = errno;
+	this->chunk(REPLAY_ADD_WATCH,wd,wd < 0 ? error : 0,path);
+	errno = error;
+	return wd;
+}
+
+
+int InotifyRecorder::rm_watch(int fd,int wd)
+{
+	return this->m_ops->rm_watch(fd,wd);
+}
+
+
+int InotifyRecorder::is_dir(const char * path)
+{
+	int ret = this->m_ops->is_dir(path);
+	int error = errno;
+	this->chunk(REPLAY_IS_DIR,ret,ret < 0 ? error : 0,path);
+	errno = error;
+	return ret;
+}
+
+
+int InotifyRecorder::list_dir(const char * path,std::vector<DirEntry> & entries)
+{
+	size_t first = entries.size();
+	int ret = this->m_ops->list_dir(path,entries);
+	int error = errno;
+
+	std::string payload;
+	int32_t head[2] = { ret, ret < 0 ? error : 0 };
+	payload.append((const char *)head,sizeof(head));
+	payload.append(path,strlen(path) + 1);
+	for(size_t i = first; i < entries.size(); i++)
+	{
+		payload.push_back((char)entries[i].type);
+		payload.append(entries[i].name.c_str(),entries[i].name.length() + 1);
+	}
+	this->chunk(REPLAY_LIST_DIR,payload.data(),payload.size());
+
+	errno = error;
+	return ret;
+}
+
+
+void InotifyRecorder::chunk(uint32_t tag,const char * data,size_t len)
+{
+	uint32_t head[2] = { tag, (uint32_t)len };
+	this->m_buffer.append((const char *)head,sizeof(head));
+	this->m_buffer.append(data,len);
+	this->m_buffer.append(REPLAY_ALIGN(len) - len,'\0');
+}
+
+
+void InotifyRecorder::chunk(uint32_t tag,int result,int error,const char * path)
+{
+	std::string payload;
+	int32_t head[2] = { result, error };
+	payload.append((const char *)head,sizeof(head));
+	payload.append(path,strlen(path) + 1);
+	this->chunk(tag,payload.data(),payload.size());
+}
+
+
+bool InotifyRecorder::flush()
+{
+	size_t total = 0;
+	while(!this->m_failed && total < this->m_buffer.size())
+	{
+		ssize_t n = ::write(this->m_fd,this->m_buffer.data() + total,this->m_buffer.size() - total);
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+		if(n <= 0) {
+			this->m_failed = true;
+			break;
+		}
+		total += n;
+	}
+
+	this->m_buffer.clear();
+	return !this->m_failed;
+}
+
+
+InotifyReplay::InotifyReplay()
+{
+	this->m_data	= NULL;
+	this->m_size	= 0;
+	this->m_cursor	= 0;
+	this->m_report	= NULL;
+}
+
+
+InotifyReplay::~InotifyReplay()
+{
+	this->close();
+}
+
+
+bool InotifyReplay::open(const char * file)
+{
+	this->close();
+
+	int fd = ::open(file,O_RDONLY);
+	if(fd == -1) {
+		return false;
+	}
+
+	struct stat st;
+	if(-1 == fstat(fd,&st) || st.st_size < REPLAY_HEADER_LEN) {
+		::close(fd);
+		return false;
+	}
+
+	/* 私有的可写映射：process_events 返回的事件指针不是 const */
+	void * addr = mmap(NULL,st.st_size,PROT_READ | PROT_WRITE,MAP_PRIVATE,fd,0);
+	::close(fd);
+	if(addr == MAP_FAILED) {
+		return false;
+	}
+
+	madvise(addr,st.st_size,MADV_SEQUENTIAL);
+	this->m_data = (char *)addr;
+	this->m_size = st.st_size;
+
+	if(replay_get32(this->m_data) != REPLAY_MAGIC || replay_get32(this->m_data + 4) != REPLAY_VERSION) {
+		this->close();
+		return false;
+	}
+
+	return true;
+}
+
+
+void InotifyReplay::close()
+{
+	if(this->m_data != NULL) {
+		munmap(this->m_data,this->m_size);
+	}
+
+	this->m_data	= NULL;
+	this->m_size	= 0;
+	this->m_cursor	= 0;
+}
+
+
+bool InotifyReplay::run(InotifyEventLoop & loop,ReplayReport & report,ProcessFunc process)
+{
+	report.clear();
+	if(this->m_data == NULL) {
+		report.error = "replay file is not open";
+		return false;
+	}
+
+	uint32_t tag,len;
+	const char * data;
+	size_t offset = REPLAY_HEADER_LEN,next;
+	if(!this->next_chunk(offset,tag,data,len,next) || tag != REPLAY_TREE) {
+		report.error = "missing initial tree snapshot";
+		return false;
+	}
+
+	loop.set_ops(this);
+	if(loop.init() == false || loop.load_tree(data,len) == false) {
+		loop.set_ops(NULL);
+		report.error = "failed to load initial tree snapshot";
+		return false;
+	}
+
+	this->m_report = &report;
+	InotifyEvent * array[8192 / sizeof(struct InotifyEvent)];
+	bool has_end = false;
+	std::string final_tree;
+
+	offset = next;
+	while(this->next_chunk(offset,tag,data,len,next))
+	{
+		if(tag == REPLAY_EVENTS) {
+			/* 处理这一批时产生的系统调用紧跟在后面 */
+			this->m_cursor = next;
+
+			uint64_t begin = replay_now_ns();
+			int number = (loop.*process)((char *)data,len,array,sizeof(array) / sizeof(array[0]));
+
+			/* 录制的一次读取可能超过 array 的大小，继续处理剩下的事件 */
+			int left = 0;
+			char * pending = loop.get_pending(left);
+			while(pending != NULL)
+			{
+				number += (loop.*process)(pending,left,array,sizeof(array) / sizeof(array[0]));
+				pending = loop.get_pending(left);
+			}
+			uint64_t cost = replay_now_ns() - begin;
+
+			report.batches++;
+			report.events += number;
+			report.total_ns += cost;
+			if(cost > report.max_ns) {
+				report.max_ns = cost;
+			}
+			report.batch_ns.push_back(cost);
+
+			next = this->m_cursor;
+		} else if(tag == REPLAY_TREE_END) {
+			final_tree.assign(data,len);
+			has_end = true;
+		} else {
+			report.skipped++;
+		}
+
+		offset = next;
+	}
+
+	this->m_report = NULL;
+	loop.set_ops(NULL);
+
+	if(offset < this->m_size) {
+		report.error = "truncated chunk at the end of the file";
+	}
+
+	std::string error;
+	if(loop.check_tree(error) == false) {
+		report.error = error;
+		return false;
+	}
+
+	if(has_end == false) {
+		if(report.error.empty()) {
+			report.error = "no final tree snapshot";
+		}
+		return false;
+	}
+
+	std::string tree;
+	loop.save_tree(tree);
+	if(tree != final_tree) {
+		report.error = "replayed tree differs from the recorded final tree";
+		return false;
+	}
+
+	report.consistent = true;
+	return true;
+}
+
+
+bool InotifyReplay::bench(ProcessFunc special,unsigned int rounds,ReplayReport & generic,ReplayReport & special_report)
+{
+	bool is_ok = true;
+	ReplayReport report;
+	generic.clear();
+	special_report.clear();
+
+	for(unsigned int i = 0; i < rounds; i++)
+	{
+		/* 交替运行，减少缓存和频率变化对某一方的偏向 */
+		for(int n = 0; n < 2; n++)
+		{
+			ReplayReport & best = n == 0 ? generic : special_report;
+			InotifyEventLoop loop;
+			bool ok = this->run(loop,report,n == 0 ? &InotifyEventLoop::process_events : special);
+			is_ok = is_ok && ok;
+			if(i == 0 || report.total_ns < best.total_ns) {
+				best = report;
+			}
+		}
+	}
+
+	return is_ok;
+}
+
+
+int InotifyReplay::init()
+{
+	/* 没有 inotify fd，给 loop 一个可以安全 close 的 fd */
+	return ::open("/dev/null",O_RDONLY);
+}
+
+
+int InotifyReplay::read(int /*fd*/,char * /*buffer*/,size_t /*size*/)
+{
+	errno = EAGAIN;
+	return -1;
+}
+
+
+int InotifyReplay::add_watch(int /*fd*/,const char * path,uint32_t /*mask*/)
+{
+	int result,error;
+	uint32_t len;
+	if(this->take(REPLAY_ADD_WATCH,path,result,error,len) == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	errno = error;
+	return result;
+}
+
+
+int InotifyReplay::rm_watch(int /*fd*/,int /*wd*/)
+{
+	return 0;
+}
+
+
+int InotifyReplay::is_dir(const char * path)
+{
+	int result,error;
+	uint32_t len;
+	if(this->take(REPLAY_IS_DIR,path,result,error,len) == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	errno = error;
+	return result;
+}
+
+
+int InotifyReplay::list_dir(const char * path,std::vector<DirEntry> & entries)
+{
+	int result,error;
+	uint32_t len;
+	const char * data = this->take(REPLAY_LIST_DIR,path,result,error,len);
+	if(data == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	const char * end = data + len;
+	const char * p = data + 8;
+	p += strnlen(p,end - p) + 1;
+	while(p < end)
+	{
+		DirEntry entry;
+		entry.type	= (unsigned char)*p++;
+		size_t name_len = strnlen(p,end - p);
+		entry.name.assign(p,name_len);
+		entries.push_back(entry);
+		p += name_len + 1;
+	}
+
+	errno = error;
+	return result;
+}
+
+
+bool InotifyReplay::next_chunk(size_t offset,uint32_t & tag,const char * & data,uint32_t & len,size_t & next)
+{
+	if(offset + REPLAY_CHUNK_LEN > this->m_size) {
+		return false;
+	}
+
+	tag		= replay_get32(this->m_data + offset);
+	len		= replay_get32(this->m_data + offset + 4);
+	data	= this->m_data + offset + REPLAY_CHUNK_LEN;
+	if(len > this->m_size - offset - REPLAY_CHUNK_LEN) {
+		return false;
+	}
+
+	next = offset + REPLAY_CHUNK_LEN + REPLAY_ALIGN(len);
+	if(next > this->m_size) {
+		next = this->m_size;
+	}
+	return true;
+}
+
+
+const char * InotifyReplay::take(uint32_t tag,const char * path,int & result,int & error,uint32_t & len)
+{
+	uint32_t chunk_tag;
+	const char * data;
+	size_t next;
+
+	/* 批次之外调用（例如回放后再 add_root）或者已经走到下一批：与录制不一致 */
+	if(this->m_report == NULL || !this->next_chunk(this->m_cursor,chunk_tag,data,len,next) ||
+		chunk_tag != tag || len < 8 || memchr(data + 8,'\0',len - 8) == NULL) {
+		if(this->m_report != NULL) {
+			this->m_report->diverged++;
+		}
+		return NULL;
+	}
+
+	if(strcmp(data + 8,path) != 0) {
+		this->m_report->diverged++;
+		return NULL;
+	}
+
+	int32_t head[2];
+	memcpy(head,data,sizeof(head));
+	result	= head[0];
+	error	= head[1];
+
+	this->m_cursor = next;
+	this->m_report->ops++;
+	return data;
+}
+
+
+}//namespace inotify
@@ -0,0 +1,181 @@
+#ifndef __INOTIFY_REPLAY_H__
+#define __INOTIFY_REPLAY_H__
+
+
+/*
+    replay
+    read_event 的目录树维护（新建目录的递归监控、改名、删除）只有在真实的事件风暴下才会出问题或变慢
+    InotifyRecorder 录制开始时的目录树快照、每次 read 读到的原始事件、以及处理事件时的系统调用结果
+    InotifyReplay 在没有 inotify fd 的情况下把录制的事件按批次交给 process_events，系统调用按录制的结果返回
+    回放报告每批的处理时间，结束时与录制结束时的目录树快照比较，可以同时用作回归测试和性能基准
+
+    文件格式（主机字节序）：
+        header      magic(u32 'IERP') version(u32)
+        chunk       tag(u32) len(u32) payload(len 字节，补齐到 8 字节)
+    tag：
+        REPLAY_TREE         开始时的目录树（save_tree）
+        REPLAY_EVENTS       一次 read 读到的原始事件
+        REPLAY_ADD_WATCH    wd(i32) errno(i32) path
+        REPLAY_IS_DIR       result(i32) errno(i32) path
+        REPLAY_LIST_DIR     result(i32) errno(i32) path '\0' 然后每项 d_type(u8) name '\0'
+        REPLAY_TREE_END     结束时的目录树
+
+    录制期间调用 add_root、remove_root、retry_crawl、poll_evicted 产生的系统调用不属于任何批次，
+    回放时会被跳过并计入 skipped，最终的目录树也会因此不一致
+*/
+
+#include <string>
+#include <vector>
+#include "InotifyEventLoop.h"
+
+
+#define REPLAY_MAGIC            0x50524549      /* "IERP" */
+#define REPLAY_VERSION          1
+
+#define REPLAY_TREE             1
+#define REPLAY_EVENTS           2
+#define REPLAY_ADD_WATCH        3
+#define REPLAY_IS_DIR           4
+#define REPLAY_LIST_DIR         5
+#define REPLAY_TREE_END         6
+
+
+namespace inotify {
+
+class InotifyRecorder : public InotifyOps
+{
+public:
+    InotifyRecorder();
+    ~InotifyRecorder();
+
+public:
+    /*
+    *   开始录制：写入文件头和目录树快照，替换 loop 的系统调用，loop 需要已经 init
+    *       loop:  被录制的 loop    input
+    *       file:  录制文件          input
+    *     return:  true 成功，fales 失败
+    */
+    bool    start(InotifyEventLoop * loop,const char * file);
+
+    /*
+    *   写入结束时的目录树快照，恢复 loop 的系统调用
+    *     return:  true 成功，fales 录制过程中写文件失败
+    */
+    bool    stop();
+
+public:
+    int     init();
+    int     read(int fd,char * buffer,size_t size);
+    int     add_watch(int fd,const char * path,uint32_t mask);
+    int     rm_watch(int fd,int wd);
+    int     is_dir(const char * path);
+    int     list_dir(const char * path,std::vector<DirEntry> & entries);
+
+private:
+    void    chunk(uint32_t tag,const char * data,size_t len);
+    void    chunk(uint32_t tag,int result,int error,const char * path);
+    bool    flush();
+
+private:
+    InotifyEventLoop *              m_loop;
+    InotifyOps *                    m_ops;          /* 被替换的系统调用 */
+    int                             m_fd;
+    bool                            m_failed;
+    std::string                     m_buffer;       /* 攒够后一次写入 */
+};
+
+
+struct ReplayReport {
+    ReplayReport() { this->clear(); }
+
+    void  clear()
+    {
+        this->batches       = 0;
+        this->events        = 0;
+        this->ops           = 0;
+        this->skipped       = 0;
+        this->diverged      = 0;
+        this->total_ns      = 0;
+        this->max_ns        = 0;
+        this->batch_ns.clear();
+        this->consistent    = false;
+        this->error.clear();
+    }
+
+    uint64_t  per_event_ns() const
+    {
+        return this->events != 0 ? this->total_ns / this->events : 0;
+    }
+
+    unsigned int                batches;
+    unsigned int                events;
+    unsigned int                ops;            /* 按录制结果返回的系统调用 */
+    unsigned int                skipped;        /* 没有被回放消费的系统调用 */
+    unsigned int                diverged;       /* 调用顺序或路径与录制不一致的次数 */
+    uint64_t                    total_ns;
+    uint64_t                    max_ns;
+    std::vector<uint64_t>       batch_ns;       /* 每批 process_events 的耗时 */
+    bool                        consistent;     /* 目录树结构一致且与录制结束时的快照相同 */
+    std::string                 error;
+};
+
+
+class InotifyReplay : public InotifyOps
+{
+public:
+    /* InotifyEventLoop::process_events 或者 process_events_as<MASK,RECURSIVE> */
+    typedef int (InotifyEventLoop::*ProcessFunc)(char * buffer,int count,InotifyEvent * array[],uint16_t size);
+
+public:
+    InotifyReplay();
+    ~InotifyReplay();
+
+public:
+    /*
+    *   以 mmap 打开录制文件
+    *     return:  true 成功，fales 失败
+    */
+    bool    open(const char * file);
+    void    close();
+
+    /*
+    *   回放整个文件
+    *       loop:  没有 init 过的 loop，回放结束后保留回放得到的目录树     input
+    *     report:  回放结果       output
+    *    process:  处理每一批事件的函数      input
+    *     return:  true 回放完成并且目录树一致
+    */
+    bool    run(InotifyEventLoop & loop,ReplayReport & report,ProcessFunc process = &InotifyEventLoop::process_events);
+
+    /*
+    *   比较通用版本和特化版本的每事件开销：两者交替各回放 rounds 次，每次使用新的 loop，保留耗时最少的一次
+    *   special:  特化版本，例如 &InotifyEventLoop::process_events_as<IN_ALL_EVENTS,true>    input
+    *   generic:  通用版本的结果        output
+    *   special_report:  特化版本的结果  output
+    *    return:  true 两者都回放完成并且目录树一致
+    */
+    bool    bench(ProcessFunc special,unsigned int rounds,ReplayReport & generic,ReplayReport & special_report);
+
+public:
+    int     init();
+    int     read(int fd,char * buffer,size_t size);
+    int     add_watch(int fd,const char * path,uint32_t mask);
+    int     rm_watch(int fd,int wd);
+    int     is_dir(const char * path);
+    int     list_dir(const char * path,std::vector<DirEntry> & entries);
+
+private:
+    bool    next_chunk(size_t offset,uint32_t & tag,const char * & data,uint32_t & len,size_t & next);
+    const char * take(uint32_t tag,const char * path,int & result,int & error,uint32_t & len);
+
+private:
+    char *                          m_data;
+    size_t                          m_size;
+    size_t                          m_cursor;       /* 下一个待消费的系统调用 */
+    ReplayReport *                  m_report;
+};
+
+
+}//namespace inotify
+
+#endif
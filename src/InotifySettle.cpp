@@ -0,0 +1,264 @@
+#include "InotifySettle.h"
+
+extern "C" {
+	#include <stdint.h>
+	#include <time.h>
+}
+
+
+namespace inotify {
+
+InotifySettle::InotifySettle(unsigned int quiet_ms,unsigned int tick_ms,unsigned int slots)
+{
+	this->m_quiet_ms		= quiet_ms;
+	this->m_tick_ms			= tick_ms > 0 ? tick_ms : 1;
+	this->m_started			= false;
+	this->m_current_tick	= 0;
+	this->m_active			= 0;
+
+	this->m_slots.assign(slots > 0 ? slots : 1,-1);
+}
+
+
+InotifySettle::~InotifySettle()
+{
+}
+
+
+void InotifySettle::feed(const InotifyEvent * event,uint64_t now_ms)
+{
+	if(event == NULL || event->wd < 0 || event->len != 0) {
+		return;
+	}
+
+	if(event->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+		this->forget(event->wd);
+		return;
+	}
+
+	if(!(event->mask & (IN_MODIFY | IN_CLOSE_WRITE))) {
+		return;
+	}
+
+	if(this->m_started == false) {
+		this->m_current_tick	= now_ms / this->m_tick_ms;
+		this->m_started 		= true;
+	}
+
+	SettleNode * n = this->node(event->wd);
+	n->last_active = now_ms;
+
+	if(event->mask & IN_CLOSE_WRITE) {
+		this->make_ready(event->wd,IN_CLOSE_WRITE);
+		return;
+	}
+
+	/* 向上取整到 tick，保证处理到该槽时 deadline 已经到期 */
+	n->deadline = now_ms + this->m_quiet_ms;
+	uint64_t tick = (n->deadline + this->m_tick_ms - 1) / this->m_tick_ms;
+	if(tick <= this->m_current_tick) {
+		tick = this->m_current_tick + 1;
+	}
+
+	this->unlink(event->wd);
+	this->link(event->wd,(int)(tick % this->m_slots.size()));
+}
+
+
+int InotifySettle::settle(SettleEvent array[],uint16_t size,uint64_t now_ms)
+{
+	if(this->m_started == false) {
+		return 0;
+	}
+
+	this->advance(now_ms);
+
+	int number = 0;
+	while(number < size && !this->m_ready.empty())
+	{
+		int wd = this->m_ready.front();
+		this->m_ready.pop_front();
+
+		SettleNode * n = &this->m_nodes[wd];
+		n->queued = false;
+		if(n->slot != SLOT_READY) {
+			continue;
+		}
+
+		array[number].wd			= wd;
+		array[number].mask			= n->mask;
+		array[number].last_active	= n->last_active;
+		number++;
+
+		n->slot = SLOT_NONE;
+		this->m_active--;
+	}
+
+	return number;
+}
+
+
+void InotifySettle::forget(int wd)
+{
+	if(wd < 0 || (size_t)wd >= this->m_nodes.size()) {
+		return;
+	}
+
+	this->unlink(wd);
+}
+
+
+int InotifySettle::next_timeout(uint64_t now_ms)
+{
+	if(this->m_active == 0) {
+		return -1;
+	}
+
+	if(!this->m_ready.empty()) {
+		return 0;
+	}
+
+	/* 只需精确到 tick，最坏情况多唤醒一次 */
+	uint64_t next = (this->m_current_tick + 1) * this->m_tick_ms;
+	if(next <= now_ms) {
+		return 0;
+	}
+
+	return (int)(next - now_ms);
+}
+
+
+size_t InotifySettle::active()
+{
+	return this->m_active;
+}
+
+
+uint64_t InotifySettle::now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+InotifySettle::SettleNode * InotifySettle::node(int wd)
+{
+	if((size_t)wd >= this->m_nodes.size()) {
+		SettleNode empty;
+		empty.slot			= SLOT_NONE;
+		empty.prev			= -1;
+		empty.next			= -1;
+		empty.queued		= false;
+		empty.mask			= 0;
+		empty.deadline		= 0;
+		empty.last_active	= 0;
+
+		size_t size = this->m_nodes.size() * 2;
+		if(size <= (size_t)wd) {
+			size = wd + 1;
+		}
+		this->m_nodes.resize(size,empty);
+	}
+
+	return &this->m_nodes[wd];
+}
+
+
+void InotifySettle::unlink(int wd)
+{
+	SettleNode * n = &this->m_nodes[wd];
+	if(n->slot == SLOT_READY) {
+		/* 已经 settled 但还没有取走，m_ready 中的旧项在 settle 时跳过 */
+		n->slot = SLOT_NONE;
+		this->m_active--;
+		return;
+	}
+
+	if(n->slot < 0) {
+		return;
+	}
+
+	if(n->prev != -1) {
+		this->m_nodes[n->prev].next = n->next;
+	} else {
+		this->m_slots[n->slot] = n->next;
+	}
+
+	if(n->next != -1) {
+		this->m_nodes[n->next].prev = n->prev;
+	}
+
+	n->prev = -1;
+	n->next = -1;
+	n->slot = SLOT_NONE;
+	this->m_active--;
+}
+
+
+void InotifySettle::link(int wd,int slot)
+{
+	SettleNode * n = &this->m_nodes[wd];
+	n->slot = slot;
+	n->prev = -1;
+	n->next = this->m_slots[slot];
+	if(n->next != -1) {
+		this->m_nodes[n->next].prev = wd;
+	}
+	this->m_slots[slot] = wd;
+	this->m_active++;
+}
+
+
+void InotifySettle::make_ready(int wd,uint32_t mask)
+{
+	SettleNode * n = &this->m_nodes[wd];
+	if(n->slot == SLOT_READY) {
+		n->mask = mask;
+		return;
+	}
+
+	this->unlink(wd);
+	n->slot = SLOT_READY;
+	n->mask = mask;
+	this->m_active++;
+
+	if(n->queued == false) {
+		n->queued = true;
+		this->m_ready.push_back(wd);
+	}
+}
+
+
+void InotifySettle::advance(uint64_t now_ms)
+{
+	uint64_t target = now_ms / this->m_tick_ms;
+	if(target <= this->m_current_tick) {
+		return;
+	}
+
+	/* 超过一圈时每个槽只需要扫描一次 */
+	uint64_t first = this->m_current_tick + 1;
+	if(target - this->m_current_tick > this->m_slots.size()) {
+		first = target - this->m_slots.size() + 1;
+	}
+
+	for(uint64_t tick = first; tick <= target; tick++)
+	{
+		int slot = (int)(tick % this->m_slots.size());
+		int wd = this->m_slots[slot];
+		while(wd != -1)
+		{
+			int next = this->m_nodes[wd].next;
+			if(this->m_nodes[wd].deadline <= now_ms) {
+				this->make_ready(wd,IN_MODIFY);
+			}
+			wd = next;
+		}
+	}
+
+	this->m_current_tick = target;
+}
+
+
+}//namespace inotify
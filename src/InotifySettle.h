@@ -0,0 +1,117 @@
+#ifndef __INOTIFY_SETTLE_H__
+#define __INOTIFY_SETTLE_H__
+
+
+/*
+    settle
+    文件写入完成（静默）检测
+    对每个文件的 IN_MODIFY 记录最后活动时间，挂在时间轮上，
+    静默 quiet_ms 之后或收到 IN_CLOSE_WRITE 时输出一次 "settled" 事件
+    每个事件的处理代价为 O(1)，可支撑几十万个同时活跃的文件
+    只跟踪文件自身 wd 上的事件：目录上带 name 的事件被忽略，
+    所以非递归的目录根（没有为子文件单独添加监控）下不会产生 settled 事件
+*/
+
+#include <vector>
+#include <deque>
+#include "InotifyEventLoop.h"
+
+
+namespace inotify {
+
+struct SettleEvent {
+    int                         wd;             /* 文件的 watch descriptor */
+    uint32_t                    mask;           /* IN_CLOSE_WRITE：写关闭   IN_MODIFY：静默超时 */
+    uint64_t                    last_active;    /* 最后一次活动的时间 ms */
+};
+
+
+class InotifySettle
+{
+public:
+    /*
+    *   quiet_ms:  静默多久认为写入完成，单位 ms           input
+    *    tick_ms:  时间轮的精度，单位 ms                   input
+    *      slots:  时间轮的槽数                            input
+    */
+    InotifySettle(unsigned int quiet_ms = 2000,unsigned int tick_ms = 50,unsigned int slots = 1024);
+    ~InotifySettle();
+
+public:
+    /*
+    *   将 read_event 读到的事件送入检测
+    *   只处理文件自身 wd 上的事件（event->len == 0），即 add_watch_file / add_watch_recursively
+    *   为文件单独添加的监控；目录上带 name 的子文件事件会被忽略
+    *      event:  事件                 input
+    *     now_ms:  当前时间 ms          input
+    */
+    void    feed(const InotifyEvent * event,uint64_t now_ms);
+
+    /*
+    *   推进时间轮，输出已经 settled 的文件
+    *      array:  SettleEvent 数组     output
+    *       size:  数组大小             input
+    *     now_ms:  当前时间 ms          input
+    *     return:  输出的事件数量，未输出完的留到下次
+    */
+    int     settle(SettleEvent array[],uint16_t size,uint64_t now_ms);
+
+    /*
+    *   不再跟踪 wd，例如 remove_watch_wd 之后
+    */
+    void    forget(int wd);
+
+    /*
+    *   距离下一次可能有 settled 事件的时间，可用作 epoll_wait 的超时
+    *     return:  ms，没有活跃文件时返回 -1
+    */
+    int     next_timeout(uint64_t now_ms);
+
+    /*
+    *   正在跟踪（尚未 settled）的文件数量
+    */
+    size_t  active();
+
+    /*
+    *   单调时钟的当前时间 ms
+    */
+    static uint64_t now_ms();
+
+private:
+    struct SettleNode {
+        int                     slot;           /* 所在的槽, SLOT_NONE / SLOT_READY / 时间轮槽 */
+        int                     prev;
+        int                     next;
+        bool                    queued;         /* 是否已经在 m_ready 中 */
+        uint32_t                mask;
+        uint64_t                deadline;
+        uint64_t                last_active;
+    };
+
+    enum {
+        SLOT_NONE  = -1,
+        SLOT_READY = -2
+    };
+
+    SettleNode* node(int wd);
+    void        unlink(int wd);
+    void        link(int wd,int slot);
+    void        make_ready(int wd,uint32_t mask);
+    void        advance(uint64_t now_ms);
+
+private:
+    unsigned int                    m_quiet_ms;
+    unsigned int                    m_tick_ms;
+    bool                            m_started;
+    uint64_t                        m_current_tick;
+    size_t                          m_active;
+
+    std::vector<SettleNode>         m_nodes;        /* 以 wd 为下标 */
+    std::vector<int>                m_slots;        /* 每个槽的链表头 wd */
+    std::deque<int>                 m_ready;
+};
+
+
+}//namespace inotify
+
+#endif